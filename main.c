@@ -1,14 +1,39 @@
 /* Test driver for n-gram generation library
  * <https://github.com/howerj/ngram */
+#ifndef NGRAM_USE_LIBRARY /* build with the header only library, inlining file I/O */
+static int file_get(void *in);
+static int file_put(int ch, void *out);
+static inline int pipe_get(void *in);
+#define NGRAM_GET(IO) ((IO)->get == pipe_get ? pipe_get((IO)->in) :\
+		(IO)->get == file_get ? file_get((IO)->in) : (IO)->get((IO)->in))
+#define NGRAM_PUT(CH, IO) ((IO)->put == file_put ? file_put((CH), (IO)->out) : (IO)->put((CH), (IO)->out))
+#define NGRAM_IMPLEMENTATION
+#endif
 #include "ngram.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/* The pipelined reader needs threads and atomics, the latter are GCC/Clang
+ * builtins as this program is written in C99 */
+#if NGRAM_THREADS && defined(__GNUC__)
+#define PIPELINE (1)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#else
+#define PIPELINE (0)
+#endif
+
+#define PIPE_BUFFERS (4)
+#define PIPE_SIZE    (1ul << 20)
+#define PIPE_SPIN    (64) /* times to yield before sleeping */
+
 #define UNUSED(X) ((void)(X))
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y) ((X) < (Y) ? (Y) : (X))
@@ -35,8 +60,34 @@ typedef struct {
 typedef struct {
 	double avg_len;
 	size_t min_len, max_len, ngrams;
+	size_t tree, frozen; /* approximate bytes used by the tree, and if frozen */
 } ngram_stats_t;
 
+typedef struct {
+	uint8_t *b;
+	size_t l, sz, pos;
+} ngram_input_t; /* all of the input, for when it has to be read twice */
+
+/* A single producer, single consumer, ring of buffers. The reader thread
+ * fills buffers from a file and publishes them by incrementing 'head', the
+ * thread generating n-grams consumes them and hands them back by
+ * incrementing 'tail'. A zero length buffer marks the end of input. Either
+ * side spins briefly when it has to wait, then sleeps on 'cond', which is
+ * signalled after every change to 'head' or 'tail'. */
+typedef struct {
+	FILE *in;
+	uint8_t *bufs[PIPE_BUFFERS];
+	size_t lens[PIPE_BUFFERS];
+	unsigned long head, tail; /* written by reader and consumer respectively */
+	const uint8_t *cur;       /* consumer only: current buffer and position */
+	size_t pos, len;
+	int started, eof, error;
+#if PIPELINE
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} ngram_pipe_t;
+
 static int ignore_case = 0;
 
 static int hexCharToNibble(int c) {
@@ -59,6 +110,153 @@ static int file_put(int ch, void *out) {
 	return fputc(ch, (FILE*)out);
 }
 
+static int input_get(void *in) {
+	assert(in);
+	ngram_input_t *i = in;
+	return i->pos < i->l ? i->b[i->pos++] : -1;
+}
+
+static int input_read(ngram_io_t *io, ngram_input_t *i) {
+	assert(io);
+	assert(i);
+	for (int ch = 0; (ch = io->get(io->in)) != -1; i->b[i->l++] = ch) {
+		if (i->l >= i->sz) {
+			const size_t sz = i->sz ? i->sz * 2 : 65536;
+			uint8_t *b = realloc(i->b, sz);
+			if (!b)
+				return -1;
+			i->b = b;
+			i->sz = sz;
+		}
+	}
+	return 0;
+}
+
+#if PIPELINE
+#define LOAD(P)     __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define STORE(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+
+static void pipe_signal(ngram_pipe_t *p) {
+	assert(p);
+	pthread_mutex_lock(&p->lock);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* wait until the reader has published 'head', or has returned 'tail' */
+static void pipe_wait(ngram_pipe_t *p, const unsigned long *v, const unsigned long until) {
+	assert(p);
+	assert(v);
+	for (int i = 0; i < PIPE_SPIN; i++) {
+		if (LOAD(v) != until)
+			return;
+		sched_yield();
+	}
+	pthread_mutex_lock(&p->lock);
+	while (LOAD(v) == until)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *pipe_reader(void *arg) {
+	assert(arg);
+	ngram_pipe_t *p = arg;
+	for (unsigned long head = p->head;; head++) {
+		if (head - LOAD(&p->tail) >= PIPE_BUFFERS) /* all buffers full */
+			pipe_wait(p, &p->tail, head - PIPE_BUFFERS);
+		const size_t slot = head % PIPE_BUFFERS;
+		/* 'read' is used instead of 'fread' so that a partially filled
+		 * buffer is passed on as soon as data is available. */
+		ssize_t l = 0;
+		do
+			l = read(fileno(p->in), p->bufs[slot], PIPE_SIZE);
+		while (l < 0 && errno == EINTR);
+		p->lens[slot] = l > 0 ? l : 0;
+		if (l < 0)
+			p->error = 1;
+		STORE(&p->head, head + 1);
+		pipe_signal(p);
+		if (l <= 0)
+			return NULL;
+	}
+}
+
+static int pipe_next(ngram_pipe_t *p) {
+	assert(p);
+	if (p->eof)
+		return -1;
+	if (p->started) { /* hand back the buffer we have finished with */
+		STORE(&p->tail, p->tail + 1);
+		pipe_signal(p);
+	}
+	p->started = 1;
+	pipe_wait(p, &p->head, p->tail);
+	const size_t slot = p->tail % PIPE_BUFFERS;
+	p->cur = p->bufs[slot];
+	p->len = p->lens[slot];
+	p->pos = 0;
+	if (p->len == 0) {
+		p->eof = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static inline int pipe_get(void *in) {
+	assert(in);
+	ngram_pipe_t *p = in;
+	if (p->pos >= p->len && pipe_next(p) < 0)
+		return -1;
+	const int r = p->cur[p->pos++];
+	return ignore_case ? tolower(r) : r;
+}
+
+static int pipe_open(ngram_pipe_t *p, FILE *in, pthread_t *reader) {
+	assert(p);
+	assert(in);
+	assert(reader);
+	memset(p, 0, sizeof *p);
+	p->in = in;
+	for (size_t i = 0; i < PIPE_BUFFERS; i++)
+		if (!(p->bufs[i] = malloc(PIPE_SIZE)))
+			goto fail;
+	if (pthread_mutex_init(&p->lock, NULL))
+		goto fail;
+	if (pthread_cond_init(&p->cond, NULL)) {
+		pthread_mutex_destroy(&p->lock);
+		goto fail;
+	}
+	if (pthread_create(reader, NULL, pipe_reader, p)) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		goto fail;
+	}
+	return 0;
+fail:
+	for (size_t i = 0; i < PIPE_BUFFERS; i++)
+		free(p->bufs[i]);
+	return -1;
+}
+
+static int pipe_close(ngram_pipe_t *p, pthread_t reader) {
+	assert(p);
+	while (pipe_next(p) >= 0) /* drain, in case of early exit */
+		;
+	if (pthread_join(reader, NULL))
+		return -1;
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	for (size_t i = 0; i < PIPE_BUFFERS; i++)
+		free(p->bufs[i]);
+	return p->error ? -1 : 0;
+}
+#else
+static inline int pipe_get(void *in) {
+	UNUSED(in);
+	return -1;
+}
+#endif
+
 /* converts up to two characters and returns number of characters converted */
 static int hexStr2ToInt(const char *str, int *const val) {
 	assert(str);
@@ -190,7 +388,7 @@ static int usage(FILE *out, const char *arg0) {
 	const int y = (version >>  8) & 0xFF;
 	const int z = (version >>  0) & 0xFF;
 	static const char *fmt ="\
-usage: %s [-hibtwWvt] [-d delimiters] [-lH integer] [-n length] [-s separator]\n\n\
+usage: %s [-hibtwWvtpfSE] [-d delimiters] [-lHjekm integer] [-n length] [-s separator] [-x decay]\n\n\
 Project : ngram - generate n-grams from arbitrary data\n\
 Author  : Richard James Howe\n\
 License : The Unlicense\n\
@@ -213,7 +411,16 @@ Options:\n\n\
   -W        use any character that is not alphanumeric as a delimiter\n\
   -l #      minimum n-gram count to print, maximum if -H not used\n\
   -H #      maximum n-gram count to generate\n\
-  -n #      instead of using a delimiter, read # in bytes at a time\n\n";
+  -n #      instead of using a delimiter, read # in bytes at a time\n\
+  -j #      number of threads to use when printing\n\
+  -p        read input on a separate thread\n\
+  -f        freeze the n-grams into a compact form before printing\n\
+  -e #      count over epochs of # tokens, printing after each epoch\n\
+  -k #      number of epochs to keep counts for, default is 1\n\
+  -x float  weight of an epoch relative to the next newest, default 1\n\
+  -S        count single bytes by sorting the input instead of using a tree\n\
+  -E        estimate the number of distinct n-grams of each length and exit\n\
+  -m #      refuse to generate n-grams if they would need more than # MiB\n\n";
 	return fprintf(out, fmt, arg0, x, y, z, o);
 }
 
@@ -246,24 +453,62 @@ static size_t total_bytes(ngram_t *n, ngram_stats_t *s) {
 	return r;
 }
 
+static size_t tree_bytes(ngram_t *n) {
+	if (!n)
+		return 0;
+	size_t r = sizeof *n + n->ml + n->nl * sizeof *n->ns;
+	for (size_t i = 0; i < n->nl; i++)
+		r += tree_bytes(n->ns[i]);
+	return r;
+}
+
 static int stats(ngram_t *n, ngram_stats_t *s) {
 	assert(s);
 	s->ngrams = count(n);
+	s->tree = tree_bytes(n);
 	s->min_len = n->nl ? SIZE_MAX : 0;
 	if (s->ngrams)
 		s->avg_len = ((double)total_bytes(n, s)) / (double)(s->ngrams);
 	return 0;
 }
 
+/* Print the counts over the most recent epochs every time an epoch
+ * completes, and once more at the end of input if it ended mid epoch. */
+static int windowed(ngram_io_t *io, ngram_print_t *p, const uint8_t *delims, size_t length, size_t epoch, int epochs, double decay) {
+	assert(io);
+	assert(p);
+	ngram_window_t *w = ngram_window(p->max, delims, length, epoch, epochs, decay);
+	if (!w)
+		return -1;
+	for (int r = 0, first = 1; (r = ngram_window_feed(w, io)) != 0; first = 0) {
+		if (r < 0)
+			goto fail;
+		ngram_t *root = ngram_window_snapshot(w);
+		if (!root)
+			goto fail;
+		const int pr = !first && io->put('\n', io->out) < 0 ? -1 : ngram_print(root, io, p);
+		ngram_free(root);
+		if (pr < 0)
+			goto fail;
+	}
+	return ngram_window_free(w);
+fail:
+	(void)ngram_window_free(w);
+	return -1;
+}
+
 int main(int argc, char **argv) {
 	uint8_t *delims = NULL;
 	uint8_t set[256] = { 0 };
 	char *odelim = NULL;
 	size_t dl = 0;
-	int bcount = 1, verbose = 0;
+	int bcount = 1, verbose = 0, pipelined = 0, freeze = 0, epochs = 1, batch = 0, estimate = 0;
+	unsigned long limit = 0;
+	size_t epoch = 0;
+	double decay = 1.0;
 	ngram_getopt_t opt = { .init = 0 };
-	ngram_print_t p = { .min = -1, .max = -1, .tree = 0, .merge = 0, .sep = ',', };
-	for (int ch = 0; (ch = ngram_getopt(&opt, argc, argv, "hibtvl:H:d:wWn:s:")) != -1;) {
+	ngram_print_t p = { .min = -1, .max = -1, .tree = 0, .merge = 0, .sep = ',', .threads = 1, };
+	for (int ch = 0; (ch = ngram_getopt(&opt, argc, argv, "hibtvl:H:d:wWn:s:j:pfe:k:x:SEm:")) != -1;) {
 		switch (ch) {
 		case 'h': usage(stdout, argv[0]); return 0;
 		case 'i': ignore_case = 1; break;
@@ -279,6 +524,15 @@ int main(int argc, char **argv) {
 		case 'w': delims = set; dl = prepare_set(set, isspace, 0); break;
 		case 'W': delims = set; dl = prepare_set(set, isalnum, 1); break;
 		case 'n': bcount = atoi(opt.arg); break;
+		case 'j': p.threads = atoi(opt.arg); break;
+		case 'p': pipelined = 1; break;
+		case 'f': freeze = 1; break;
+		case 'e': epoch = strtoul(opt.arg, NULL, 0); break;
+		case 'k': epochs = atoi(opt.arg); break;
+		case 'x': decay = atof(opt.arg); break;
+		case 'S': batch = 1; break;
+		case 'E': estimate = 1; break;
+		case 'm': limit = strtoul(opt.arg, NULL, 0); break;
 		default:
 			(void)fprintf(stderr, "bad arg -- %c\n", ch);
 			usage(stderr, argv[0]);
@@ -296,6 +550,25 @@ int main(int argc, char **argv) {
 		(void)fprintf(stderr, "bad bcount -- %d", bcount);
 		return 1;
 	}
+	if (p.threads <= 0) {
+		(void)fprintf(stderr, "bad thread count -- %d\n", p.threads);
+		return 1;
+	}
+
+	if (epochs <= 0 || !(decay >= 0.0 && decay <= 1.0)) { /* also refuses NaN */
+		(void)fprintf(stderr, "bad epochs or decay -- %d %g\n", epochs, decay);
+		return 1;
+	}
+
+	if ((estimate || limit) && (batch || epoch)) {
+		(void)fprintf(stderr, "estimates are only made for trees\n");
+		return 1;
+	}
+
+	if (batch && (delims || bcount != 1 || p.tree || freeze || epoch)) {
+		(void)fprintf(stderr, "sorting only supports single bytes and line output\n");
+		return 1;
+	}
 
 	if (delims && delims != set) {
 		const int r = unescape((char*)delims, strlen(odelim));
@@ -312,23 +585,128 @@ int main(int argc, char **argv) {
 	}
 
 	ngram_io_t io = { .get = file_get, .put = file_put, .in = stdin, .out = stdout, };
+#if PIPELINE
+	ngram_pipe_t pl;
+	pthread_t reader;
+	if (pipelined) {
+		if (pipe_open(&pl, stdin, &reader) < 0) {
+			(void)fprintf(stderr, "unable to start reader thread\n");
+			return 1;
+		}
+		io.get = pipe_get;
+		io.in = &pl;
+	}
+#else
+	if (pipelined) {
+		(void)fprintf(stderr, "pipelined reading not supported\n");
+		return 1;
+	}
+#endif
+	p.merge = !p.tree && delims == NULL;
+	if (epoch) {
+		int r = windowed(&io, &p, delims, delims ? dl : (unsigned)bcount, epoch, epochs, decay);
+#if PIPELINE
+		if (pipelined && pipe_close(&pl, reader) < 0)
+			r = -1;
+#endif
+		if (r < 0)
+			(void)fprintf(stderr, "windowed ngram generation failed\n");
+		return r < 0;
+	}
 	clock_t begin = clock();
-	ngram_t *root = ngram(&io, p.max, delims, delims ? dl : (unsigned)bcount);
+	if (batch) {
+		int r = ngram_batch(&io, p.max, &p);
+#if PIPELINE
+		if (pipelined && pipe_close(&pl, reader) < 0)
+			r = -1;
+#endif
+		if (r < 0)
+			(void)fprintf(stderr, "ngram generation failed\n");
+		else if (verbose && fprintf(stderr, "time:   %.3fs\n", (double)(clock() - begin) / CLOCKS_PER_SEC) < 0)
+			r = -1;
+		return r < 0;
+	}
+	/* With a limit the input is read again after the estimate, which also
+	 * sizes tables for the real run. A file is rewound, anything else has
+	 * to be kept in memory. */
+	ngram_input_t in = { .b = NULL, };
+	double *estimates = NULL;
+	long start = -1;
+	if (estimate || limit) {
+		size_t bytes = 0;
+		int r = (estimates = calloc(p.max, sizeof *estimates)) ? 0 : -1;
+		if (limit && !pipelined)
+			start = ftell(stdin);
+		if (r >= 0 && limit && start < 0 && (r = input_read(&io, &in)) >= 0) {
+			io.get = input_get;
+			io.in = &in;
+		}
+		if (r >= 0)
+			r = ngram_estimate(&io, p.max, delims, delims ? dl : (unsigned)bcount, estimates, &bytes);
+		for (int i = 0; r >= 0 && estimate && i < p.max; i++)
+			if (fprintf(stdout, "%d%c%.0f\n", i + 1, p.sep, estimates[i]) < 0)
+				r = -1;
+		if (r >= 0 && verbose && fprintf(stderr, "estimated memory: %lu bytes\n", (unsigned long)(bytes + in.l)) < 0)
+			r = -1;
+		if (r >= 0 && limit && bytes + in.l > limit * 1024ul * 1024ul) {
+			(void)fprintf(stderr, "estimated memory of %lu bytes exceeds the limit of %lu MiB\n", (unsigned long)(bytes + in.l), limit);
+			r = 1;
+		}
+		if (r < 0)
+			(void)fprintf(stderr, "ngram estimate failed\n");
+		if (r || estimate) {
+#if PIPELINE
+			if (pipelined && pipe_close(&pl, reader) < 0)
+				r = -1;
+#endif
+			free(in.b);
+			free(estimates);
+			return !!r;
+		}
+		in.pos = 0;
+		if (start >= 0 && fseek(stdin, start, SEEK_SET) < 0) {
+			(void)fprintf(stderr, "unable to rewind input\n");
+			free(estimates);
+			return 1;
+		}
+	}
+	ngram_t *root = ngram_sized(&io, p.max, delims, delims ? dl : (unsigned)bcount, estimates);
 	clock_t end = clock();
+	free(estimates);
+#if PIPELINE
+	if (pipelined && pipe_close(&pl, reader) < 0) {
+		(void)fprintf(stderr, "reading input failed\n");
+		ngram_free(root);
+		return 1;
+	}
+#endif
 	const double time = (double)(end - begin) / CLOCKS_PER_SEC;
 	if (!root) {
 		(void)fprintf(stderr, "ngram generation failed\n");
 		return 1;
 	}
-	p.merge = !p.tree && delims == NULL;
-	if (ngram_print(root, &io, &p) < 0) {
+	ngram_stats_t st = { .avg_len = 0 };
+	if (verbose && stats(root, &st) < 0)
+		return 2;
+	if (freeze) {
+		ngram_frozen_t *f = ngram_freeze(root);
+		if (!f) {
+			(void)fprintf(stderr, "ngram freeze failed\n");
+			return 1;
+		}
+		st.frozen = ngram_frozen_size(f);
+		ngram_free(root);
+		root = NULL;
+		if (ngram_frozen_print(f, &io, &p) < 0) {
+			(void)fprintf(stderr, "ngram print failed\n");
+			return 1;
+		}
+		ngram_frozen_free(f);
+	} else if (ngram_print(root, &io, &p) < 0) {
 		(void)fprintf(stderr, "ngram print failed\n");
 		return 1;
 	}
 	if (verbose) {
-		ngram_stats_t st = { .avg_len = 0 };
-		if (stats(root, &st) < 0)
-			return 2;
 		if (fprintf(stderr, "time:   %.3fs\n", time) < 0)
 			return 1;
 		if (fprintf(stderr, "ngrams: %u\n", (unsigned)st.ngrams) < 0)
@@ -339,8 +717,12 @@ int main(int argc, char **argv) {
 			return 1;
 		if (fprintf(stderr, "max ln: %u\n", (unsigned)st.max_len) < 0)
 			return 1;
+		if (fprintf(stderr, "tree:   %lu bytes\n", (unsigned long)st.tree) < 0)
+			return 1;
+		if (freeze && fprintf(stderr, "frozen: %lu bytes\n", (unsigned long)st.frozen) < 0)
+			return 1;
 	}
 	ngram_free(root);
+	free(in.b);
 	return 0;
 }
-
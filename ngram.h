@@ -1,9 +1,44 @@
+/* Project : ngram.h - Generate n-grams, header only library
+ * Author  : Richard James Howe
+ * License : Public Domain
+ * Email   : howe.r.j.89@gmail.com
+ * Website : <https://github.com/howerj/ngram> 
+ *
+ * Define NGRAM_IMPLEMENTATION in one translation unit before including this
+ * header to get the implementation. The following macros may also be
+ * defined before inclusion to specialize the library at compile time:
+ *
+ * - NGRAM_BYTE_MODE: -1 (default) selects the tokenizer at run time, 1
+ *   only supports splitting into bytes, 0 only supports delimiters.
+ * - NGRAM_MAX_N: 0 (default) for no limit, otherwise the largest n-gram
+ *   that can be generated, removing an allocation from 'ngram'.
+ * - NGRAM_GET(IO) and NGRAM_PUT(CH, IO): replace the calls through the
+ *   'ngram_io_t' function pointers, allowing them to be inlined. They must
+ *   work for any 'ngram_io_t', the library uses its own internally.
+ * - NGRAM_THREADS: 1 (default, 0 on Windows) uses POSIX threads to sort and
+ *   print in parallel, and locks so the shared model and windowed counts can
+ *   be used from many threads. 0 does without. Link with '-pthread' when 1.
+ * - NGRAM_ATOMICS: 1 (default with threads and GCC/Clang) uses atomic
+ *   builtins for lock free lookups in the shared model, 0 uses a mutex.
+ *
+ * There are some bugs!
+ * - identical n-grams not put into the same bucket
+ * - There probables some others...
+ */
 #ifndef NGRAM_H
 #define NGRAM_H
 
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef NGRAM_THREADS /* public so includers agree with the library */
+#ifdef _WIN32
+#define NGRAM_THREADS (0)
+#else
+#define NGRAM_THREADS (1)
+#endif
+#endif
+
 struct ngram {
 	struct ngram *parent; /* parent of this n-gram */
 	struct ngram **ns;    /* sorted list of n-gram children */
@@ -24,6 +59,7 @@ typedef struct {
 
 typedef struct {
 	int min, max, sep;
+	int threads;          /* if greater than one, format subtrees of the root in parallel */
 	unsigned merge: 1, tree :1;
 } ngram_print_t;
 
@@ -31,7 +67,2558 @@ typedef struct {
 ngram_t *ngram(ngram_io_t *io, int max, const uint8_t *delimiters, size_t length);
 int ngram_print(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p);
 int ngram_free(ngram_t *n);
+
+/* Estimates how many distinct n-grams of each length, from 1 to 'max', the
+ * tree made by 'ngram' with the same arguments would hold, in one pass with
+ * a HyperLogLog sketch per length (to within a few percent). They are put
+ * in 'estimates[0]' to 'estimates[max - 1]' and if 'bytes' is not NULL it
+ * is set to an estimate of the memory needed to make the tree. */
+int ngram_estimate(ngram_io_t *io, int max, const uint8_t *delimiters, size_t length, double *estimates, size_t *bytes);
+/* 'ngram', using 'estimates' from 'ngram_estimate' to size tables up front */
+ngram_t *ngram_sized(ngram_io_t *io, int max, const uint8_t *delimiters, size_t length, const double *estimates);
+
+/* Counts single byte n-grams of up to 'max' bytes and prints them as
+ * 'ngram' followed by 'ngram_print' would, but by sorting every window of
+ * the input instead of building a tree, for one off jobs on large inputs.
+ * Only line output is supported, 'p->threads' threads are used to sort. */
+int ngram_batch(ngram_io_t *io, int max, const ngram_print_t *p);
+
+/* A model that many threads can feed at once, each with its own input.
+ * Snapshots are ordinary trees, to be printed and freed with 'ngram_free',
+ * and never contain part of an n-gram. */
+typedef struct ngram_shared ngram_shared_t;
+ngram_shared_t *ngram_shared(void);
+int ngram_shared_feed(ngram_shared_t *s, ngram_io_t *io, int max, const uint8_t *delimiters, size_t length);
+ngram_t *ngram_shared_snapshot(ngram_shared_t *s);
+int ngram_shared_free(ngram_shared_t *s);
+
+/* Counts over a window of the most recent input. Tokens are grouped into
+ * epochs of 'epoch' tokens, the counts cover the last 'epochs' complete
+ * epochs, each weighted by 'decay' raised to its age in epochs (use 1.0
+ * for a plain sliding window). 'ngram_window_feed' reads input until an
+ * epoch is complete, returning 1, or until the end of input, returning 0.
+ * 'ngram_window_snapshot' may be called from another thread and returns a
+ * tree to be printed and freed with 'ngram_free'. */
+typedef struct ngram_window ngram_window_t;
+ngram_window_t *ngram_window(int max, const uint8_t *delimiters, size_t length, size_t epoch, int epochs, double decay);
+int ngram_window_feed(ngram_window_t *w, ngram_io_t *io);
+ngram_t *ngram_window_snapshot(ngram_window_t *w);
+int ngram_window_free(ngram_window_t *w);
+
+/* A compact, read only, copy of a tree for long lived queries. The tree
+ * passed to 'ngram_freeze' is not modified and can be freed afterwards.
+ * 'ngram_frozen_count' returns the count for a list of tokens, or zero if
+ * that n-gram does not exist, and 'ngram_frozen_size' the bytes used. */
+typedef struct ngram_frozen ngram_frozen_t;
+ngram_frozen_t *ngram_freeze(const ngram_t *n);
+int ngram_frozen_print(const ngram_frozen_t *f, ngram_io_t *io, const ngram_print_t *p);
+size_t ngram_frozen_count(const ngram_frozen_t *f, const uint8_t *const *tokens, const size_t *lengths, int count);
+size_t ngram_frozen_size(const ngram_frozen_t *f);
+int ngram_frozen_free(ngram_frozen_t *f);
+
 int ngram_tests(void); /* 0  = success or NDEBUG defined, negative on fail */
 int ngram_version(unsigned long *version);
 
 #endif
+
+#ifdef NGRAM_IMPLEMENTATION
+#ifndef NGRAM_IMPLEMENTATION_H /* include guard, like NGRAM_H, so it stays defined */
+#define NGRAM_IMPLEMENTATION_H
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#ifndef NGRAM_VERSION
+#define NGRAM_VERSION (0x000000ul)
+#endif
+
+#ifdef NDEBUG
+#define NGRAM_DEBUGGING (0)
+#else
+#define NGRAM_DEBUGGING (1)
+#endif
+
+#if NGRAM_THREADS
+#include <pthread.h>
+#endif
+
+/* Lock free access to the shared model uses GCC/Clang atomic builtins,
+ * without them (or if set to 0) the shared model uses a single mutex */
+#ifndef NGRAM_ATOMICS
+#if NGRAM_THREADS && defined(__GNUC__)
+#define NGRAM_ATOMICS (1)
+#else
+#define NGRAM_ATOMICS (0)
+#endif
+#endif
+
+#if NGRAM_ATOMICS
+#include <sched.h>
+#endif
+
+#ifndef NGRAM_BYTE_MODE
+#define NGRAM_BYTE_MODE (-1)
+#endif
+
+#ifndef NGRAM_MAX_N
+#define NGRAM_MAX_N (0)
+#endif
+
+#ifndef NGRAM_GET
+#define NGRAM_GET(IO) ((IO)->get((IO)->in))
+#endif
+
+#ifndef NGRAM_PUT
+#define NGRAM_PUT(CH, IO) ((IO)->put((CH), (IO)->out))
+#endif
+
+#ifdef __GNUC__
+#define NGRAM_INLINE static inline __attribute__((always_inline))
+#else
+#define NGRAM_INLINE static inline
+#endif
+
+#define NGRAM_QUOTE_LEFT  "\""
+#define NGRAM_QUOTE_RIGHT "\""
+#define NGRAM_BINARY_SEARCH (1)
+#define NGRAM_MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#define NGRAM_MAX(X, Y) ((X) < (Y) ? (Y) : (X))
+
+typedef struct {
+	size_t l;
+	uint8_t m[];
+} ngram_v_t;
+
+typedef struct {
+	uint8_t *b;
+	size_t l, sz;
+} ngram_buffer_t; /* growable output buffer, used as an 'out' for 'ngram_buffer_put' */
+
+int ngram_version(unsigned long *version) {
+	assert(version);
+	unsigned long options = 0;
+	options |= NGRAM_DEBUGGING << 0;
+	options |= NGRAM_THREADS << 1;
+	*version = (options << 24) | NGRAM_VERSION;
+	return NGRAM_VERSION == 0 ? -1 : 0;
+}
+
+static inline int ngram_get(ngram_io_t *io) {
+	assert(io);
+	const int r = NGRAM_GET(io);
+	io->read += r >= 0;
+	assert((r >= 0 && r <= 255) || r == -1);
+	return r;
+}
+
+static inline int ngram_put(const int ch, ngram_io_t *io) {
+	assert(io);
+	const int r = NGRAM_PUT(ch, io);
+	io->wrote += r >= 0;
+	assert((r >= 0 && r <= 255) || r == -1);
+	return r;
+}
+
+static int ngram_sput(const char *s, ngram_io_t *io) {
+	assert(io);
+	assert(s);
+	size_t i = 0;
+	for (i = 0; s[i]; i++)
+		if (ngram_put(s[i], io) < 0)
+			return -1;
+	return i;
+}
+
+static int ngram_buffer_put(int ch, void *out) {
+	assert(out);
+	ngram_buffer_t *b = out;
+	if (b->l >= b->sz) {
+		const size_t sz = b->sz ? b->sz * 2 : 4096;
+		uint8_t *n = realloc(b->b, sz);
+		if (!n)
+			return -1;
+		b->b = n;
+		b->sz = sz;
+	}
+	return b->b[b->l++] = ch;
+}
+
+static int ngram_output(unsigned count, int docount, const ngram_print_t *p, const uint8_t *m, size_t l, ngram_io_t *io) {
+	assert(m);
+	assert(p);
+	assert(io);
+	size_t r = 0;
+
+	if (!(p->merge)) {
+		if (ngram_sput(NGRAM_QUOTE_LEFT, io) < 0)
+			return -1;
+		r++;
+	}
+
+	for (size_t i = 0; i < l; i++) {
+		char s[5 /* \xHH + '\0' */] = { m[i] };
+		char *p = s;
+		switch (m[i]) {
+		case '\0': p = "\\0";  break;
+		case '\\': p = "\\\\"; break;
+		case '"':  p = "\\\""; break;
+		case '\a': p = "\\a";  break;
+		case '\b': p = "\\b";  break;
+		case   27: p = "\\e";  break;
+		case '\f': p = "\\f";  break;
+		case '\n': p = "\\n";  break;
+		case '\r': p = "\\r";  break;
+		case '\t': p = "\\t";  break;
+		case '\v': p = "\\v";  break;
+		default:
+			// TODO: Remove locale dependent code
+			if (!isprint(m[i]))
+				snprintf(s, sizeof s, "\\x%X", m[i]);
+		}
+		r += strlen(p); /* strnlen(p, sizeof s) */
+		if (ngram_sput(p, io) < 0)
+			return -1;
+	}
+	if (docount) {
+		char buf[32] = { 0 };
+		int spf = snprintf(buf, sizeof buf, "%s%c%u", p->merge ? "" : NGRAM_QUOTE_RIGHT, p->sep, (unsigned)count);
+		if (spf < 0)
+			return -1;
+		const int q = ngram_sput(buf, io);
+		if (q < 0)
+			return -1;
+		r += q;
+	} else if (!(p->merge)) {
+		if (ngram_sput(NGRAM_QUOTE_RIGHT , io) < 0)
+			return -1;
+		if (ngram_put(p->sep, io) < 0)
+			return -1;
+		r += 2;
+	}
+	return r;
+}
+
+static ngram_t *ngram_mk(ngram_v_t *v) {
+	assert(v);
+	ngram_t *n = calloc(1, v->l + sizeof *n);
+	if (!n)
+		return NULL;
+	memcpy(n->m, v->m, v->l);
+	n->ml = v->l;
+	return n;
+}
+
+static int ngram_unmk(ngram_t *n) {
+	if (!n)
+		return 0;
+	const size_t l = n->nl;
+	for (size_t i = 0; i < l; i++) {
+		ngram_unmk(n->ns[i]);
+		n->ns[i] = NULL;
+	}
+	free(n->ns);
+	n->ns = NULL;
+	free(n);
+	return 0;
+}
+
+static inline int ngram_compare(const void *m, const void *n, size_t cnt) {
+	assert(m);
+	assert(n);
+	return memcmp(m, n, cnt);
+}
+
+static size_t ngram_position(const ngram_t *tree, const ngram_t *n) {
+	assert(tree);
+	assert(n);
+	/* should do binary search to find insert position...*/
+	for (size_t i = 0; i < tree->nl; i++) {
+		const ngram_t *chld = tree->ns[i];
+		// TODO: Take length into a account
+		const int m = ngram_compare(chld->m, n->m, NGRAM_MIN(chld->ml, n->ml));
+		//assert(m || chld->ml != n->ml); /* should not be inserting already existing nodes */
+		if (m > 0)
+			return i;
+	}
+	return tree->nl;
+}
+
+static int ngram_grow(ngram_t *tree, ngram_t *n) {
+	assert(tree);
+	assert(n);
+	ngram_t **old = tree->ns;
+	tree->ns = realloc(tree->ns, (tree->nl + 1) * sizeof *tree->ns);
+	if (!(tree->ns)) {
+		for (size_t i = 0; i < tree->nl; i++)
+			ngram_unmk(old[i]);
+		free(tree->ns);
+		tree->ns = NULL;
+		tree->nl = 0;
+		return -1;
+	}
+	if (NGRAM_BINARY_SEARCH) {
+		const size_t i = ngram_position(tree, n);
+		memmove(&tree->ns[i + 1], &tree->ns[i], (tree->nl - i) * sizeof *tree->ns);
+		tree->ns[i] = n;
+		tree->nl++;
+	} else {
+		tree->ns[tree->nl++] = n;
+	}
+	n->parent = tree;
+	return 0;
+}
+
+static int ngram_is(ngram_t *n, ngram_v_t *v) {
+	assert(n);
+	assert(v);
+	return n->ml == v->l && !ngram_compare(n->m, v->m, v->l);
+}
+
+NGRAM_INLINE ngram_t *ngram_find(ngram_t *n, ngram_v_t *v, const size_t width) {
+	assert(n);
+	assert(v);
+	if (NGRAM_BINARY_SEARCH) {
+		if (!(n->ns))
+			return NULL;
+		long l = 0, r = n->nl - 1;
+		while (r >= l) {
+			long m = l + (r - l) / 2;
+			ngram_t *chld = n->ns[m];
+			/* if v->l != chld->ml optimize by checking last character$a
+			 * TODO: Take length into account? */
+			const int k = width == 1 ?
+				chld->m[0] - v->m[0] :
+				ngram_compare(chld->m, v->m, NGRAM_MIN(chld->ml, v->l));
+			if (!k && chld->ml == v->l)
+				return chld;
+			if (k > 0)
+				r = m - 1;
+			else
+				l = m + 1;
+		}
+		return NULL;
+	} else {
+		const size_t l = n->nl;
+		for (size_t i = 0; i < l; i++)
+			if (ngram_is(n->ns[i], v))
+				return n->ns[i];
+	}
+	return NULL;
+}
+
+/* 'width' is non-zero if all tokens are known to be that many bytes long */
+NGRAM_INLINE int ngram_add(ngram_t *n, ngram_v_t **vs, int vl, const size_t width) {
+	assert(vs);
+	for (; n && vl > 0; vs++, vl--) {
+		ngram_t *f = ngram_find(n, vs[0], width);
+		if (!f) {
+			f = ngram_mk(vs[0]);
+			if (!f)
+				return -1;
+			if (ngram_grow(n, f) < 0)
+				return -1;
+		}
+		f->cnt++;
+		n = f;
+	}
+	return 0;
+}
+
+static int ngram_repeat(ngram_io_t *io, int ch, int cnt) {
+	assert(io);
+	assert(cnt >= 0);
+	for (int i = 0; i < cnt; i++)
+		if (ngram_put(ch, io) < 0)
+			return -1;
+	return cnt;
+}
+
+static int ngram_print_tree(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p, int depth) {
+	assert(io);
+	assert(p);
+	if (!n)
+		return 0;
+	int r = 0;
+	const int root = n->ml == 0;
+	if (!root) {
+		const int k = ngram_repeat(io, ' ', depth);
+		if (k < 0)
+			return -1;
+		r += k;
+		const int j = ngram_output(n->cnt, depth >= (p->min - 1), p, n->m, n->ml, io);
+		if (j < 0)
+			return -1;
+		r += j;
+		if (ngram_put('\n', io) < 0)
+			return -1;
+	}
+	r += 1;
+	const size_t l = n->nl;
+	for (size_t i = 0; i < l; i++) {
+		const int k = ngram_print_tree(n->ns[i], io, p, depth + !root);
+		if (k < 0)
+			return -1;
+		r += k;
+	}
+	return r;
+}
+
+static int ngram_print_up(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p) {
+	assert(io);
+	assert(p);
+	if (!n)
+		return 0;
+	int r = 0;
+	const int j = ngram_print_up(n->parent, io, p);
+	if (j < 0)
+		return -1;
+	r += j;
+	if (n->ml) {
+		const int q = ngram_output(0, 0, p, n->m, n->ml, io);
+		if (q < 0)
+			return -1;
+		r += q;
+	}
+	return r;
+}
+
+static int ngram_print_line(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p, int depth)  {
+	assert(io);
+	assert(p);
+	if (!n)
+		return 0;
+	int r = 0;
+	for (size_t i = 0; i < n->nl; i++) {
+		const int j = ngram_print_line(n->ns[i], io, p, depth + 1);
+		if (j < 0)
+			return -1;
+		r += j;
+	}
+	if (depth >= p->min && n->cnt) {
+		char buf[32] = { 0 };
+		if (snprintf(buf, sizeof buf, "%u%c", (unsigned)n->cnt, p->sep) < 0)
+			return -1;
+		const int q = ngram_sput(buf, io);
+		if (q < 0)
+			return -1;
+		r += q;
+		if (p->merge) {
+			const int k = ngram_put('"', io);
+			if (k < 0)
+				return -1;
+			r++;
+		}
+		const int j = ngram_print_up(n, io, p);
+		if (j < 0)
+			return -1;
+		if (p->merge) {
+			const int k = ngram_put('"', io);
+			if (k < 0)
+				return -1;
+			r++;
+		}
+		if (ngram_put('\n', io) < 0)
+			return -1;
+		r += j + 1;
+	}
+	return r;
+}
+
+NGRAM_INLINE int ngram_token(ngram_io_t *io, ngram_v_t **out, const int lmode, const uint8_t *delim, const size_t dlen) {
+	assert(io);
+	assert(out);
+	assert(lmode || !*out);
+	size_t i = 0;
+	ngram_v_t *n = *out, *o = NULL; /* '*out' may be a token to reuse in byte mode */
+	*out = NULL;
+	if (lmode) { /* tokenize into bytes */
+		if (!n && !(n = malloc(sizeof (*n) + dlen)))
+			return -1;
+		for (i = 0; i < dlen; i++) {
+			const int ch = ngram_get(io);
+			if (ch == -1)
+				break;
+			n->m[i] = ch;
+		}
+		if (i == 0) {
+			free(n);
+			return 0;
+		}
+	} else { /* split into words */
+		int ch = 0;
+		assert(delim);
+again:
+		for (; (ch = ngram_get(io)) != -1; i++) {
+			if (memchr(delim, ch, dlen))
+				break;
+			if (!(o = realloc(n, sizeof (*n) + i + 1))) {
+				free(n);
+				return -1;
+			}
+			n = o;
+			n->m[i] = ch;
+		}
+		if (ch == -1) {
+			free(n);
+			return 0;
+		}
+		if (i == 0)
+			goto again;
+	}
+	n->l = i;
+	*out = n;
+	return 0;
+}
+
+static int ngram_delist(ngram_v_t **ls, int max) {
+	assert(max >= 0);
+	for (int i = 0; i < max; i++) {
+		free(ls[i]);
+		ls[i] = NULL;
+	}
+	if (NGRAM_MAX_N <= 0)
+		free(ls);
+	return 0;
+}
+
+/* 'ngram_generate' is always inlined into 'ngram' with a constant 'lmode', so the
+ * tokenizer and the search are specialized for each mode (and for single
+ * byte tokens) instead of testing it per token. */
+NGRAM_INLINE ngram_t *ngram_generate(ngram_io_t *io, const int max, const uint8_t *delimiters, const size_t length, const int lmode) {
+	assert(io);
+	assert(NGRAM_MAX_N <= 0 || max <= NGRAM_MAX_N);
+	ngram_t *root = calloc(1, sizeof *root);
+#if NGRAM_MAX_N > 0
+	ngram_v_t *window[NGRAM_MAX_N] = { NULL }, **ls = window;
+#else
+	ngram_v_t **ls = calloc(1, max * sizeof *ls);
+#endif
+	if (!ls || !root) {
+		free(root);
+		if (NGRAM_MAX_N <= 0)
+			free(ls);
+		return NULL;
+	}
+	/*We could also add a set of characters to ignore, but we could just
+	* preprocess the text instead of adding complexity in here, this
+	* could be done in the I/O callback, adding case insensitivity or
+	* ignoring character sets */
+	for (int j = 1;;j += j < max) {
+		ngram_v_t *v = NULL;
+		if (lmode) { /* tokens are all the same size, recycle the oldest */
+			v = ls[0];
+			ls[0] = NULL;
+		}
+		if (ngram_token(io, &v, lmode, delimiters, length) < 0)
+			goto fail;
+		if (!v)
+			break;
+		free(ls[0]);
+		memmove(ls, ls + 1, (max - 1) * sizeof *ls);
+		ls[max - 1] = v;
+		if (ngram_add(root, ls + (max - j), j, lmode && length == 1) < 0)
+			goto fail;
+	}
+	ngram_delist(ls, max);
+	return root;
+fail:
+	ngram_delist(ls, max);
+	free(root);
+	return NULL;
+}
+
+/* Single byte tokens with n <= NGRAM_PACKED_MAX are counted without touching the
+ * tree for every byte. The last 'max' bytes are packed into a 64-bit key,
+ * oldest byte most significant so keys sort like the bytes they hold, and
+ * each full window is counted once in a hash table (or an array indexed by
+ * the key for n <= 2). The tree is then built from the sorted windows, the
+ * count of each node being the sum of the windows that pass through it,
+ * which is what 'ngram_add' would have produced. The first n - 1 windows are
+ * shorter than n and are added to the tree with 'ngram_add' afterwards. */
+#define NGRAM_PACKED_MAX (8)
+
+typedef struct {
+	uint64_t key;
+	size_t cnt;
+} ngram_slot_t;
+
+typedef struct {
+	ngram_slot_t *s;
+	size_t used, mask;
+} ngram_table_t; /* open addressing, linear probing, 'cnt == 0' is an empty slot */
+
+static inline size_t ngram_hash64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+	return k;
+}
+
+static int ngram_table_grow(ngram_table_t *t) {
+	assert(t);
+	const size_t sz = (t->mask + 1) * 2;
+	ngram_slot_t *s = calloc(sz, sizeof *s);
+	if (!s)
+		return -1;
+	for (size_t i = 0; i <= t->mask; i++) {
+		if (!(t->s[i].cnt))
+			continue;
+		size_t h = ngram_hash64(t->s[i].key) & (sz - 1);
+		while (s[h].cnt)
+			h = (h + 1) & (sz - 1);
+		s[h] = t->s[i];
+	}
+	free(t->s);
+	t->s = s;
+	t->mask = sz - 1;
+	return 0;
+}
+
+static inline int ngram_table_add(ngram_table_t *t, const uint64_t key) {
+	assert(t);
+	size_t h = ngram_hash64(key) & t->mask;
+	for (; t->s[h].cnt; h = (h + 1) & t->mask) {
+		if (t->s[h].key == key) {
+			t->s[h].cnt++;
+			return 0;
+		}
+	}
+	t->s[h].key = key;
+	t->s[h].cnt = 1;
+	if (++t->used * 4 >= (t->mask + 1) * 3)
+		return ngram_table_grow(t);
+	return 0;
+}
+
+static int ngram_compare_slot(const void *a, const void *b) {
+	assert(a);
+	assert(b);
+	const uint64_t x = ((const ngram_slot_t*)a)->key, y = ((const ngram_slot_t*)b)->key;
+	return x < y ? -1 : x > y;
+}
+
+static int ngram_append(ngram_t *tree, ngram_t *n) { /* children must arrive in order */
+	assert(tree);
+	assert(n);
+	if (!(tree->nl & (tree->nl - 1))) { /* capacity is the next power of two */
+		ngram_t **ns = realloc(tree->ns, (tree->nl ? tree->nl * 2 : 1) * sizeof *ns);
+		if (!ns)
+			return -1;
+		tree->ns = ns;
+	}
+	tree->ns[tree->nl++] = n;
+	n->parent = tree;
+	return 0;
+}
+
+static int ngram_build(ngram_t *root, const ngram_slot_t *s, const size_t l, const int max) {
+	assert(root);
+	assert(s || l == 0);
+	assert(max > 0 && max <= NGRAM_PACKED_MAX);
+	ngram_t *path[NGRAM_PACKED_MAX + 1] = { root, };
+	for (size_t i = 0; i < l; i++) {
+		int k = 0;
+		if (i) { /* reuse the nodes shared with the previous window */
+			const uint64_t x = s[i].key ^ s[i - 1].key;
+			while (k < max && !((x >> (8 * (max - 1 - k))) & 0xFF))
+				k++;
+		}
+		for (; k < max; k++) {
+			ngram_t *n = calloc(1, sizeof *n + 1);
+			if (!n)
+				return -1;
+			n->m[0] = s[i].key >> (8 * (max - 1 - k));
+			n->ml = 1;
+			if (ngram_append(path[k], n) < 0) {
+				free(n);
+				return -1;
+			}
+			path[k + 1] = n;
+		}
+		for (k = 1; k <= max; k++)
+			path[k]->cnt += s[i].cnt;
+	}
+	return 0;
+}
+
+/* 'hint' is the expected number of distinct windows, or zero if unknown */
+static ngram_t *ngram_packed(ngram_io_t *io, const int max, const size_t hint) {
+	assert(io);
+	assert(max > 0 && max <= NGRAM_PACKED_MAX);
+	const int dense = max <= 2;
+	const uint64_t mask = max == NGRAM_PACKED_MAX ? UINT64_MAX : ((uint64_t)1 << (8 * max)) - 1;
+	ngram_t *root = calloc(1, sizeof *root);
+	ngram_table_t t = { .mask = dense ? (size_t)mask : 1023, };
+	/* leave some room for the error of the estimate, so it never grows */
+	while (!dense && hint && t.mask < SIZE_MAX / 8 && (t.mask + 1) * 3 / 4 <= hint + hint / 8)
+		t.mask = t.mask * 2 + 1;
+	uint8_t first[NGRAM_PACKED_MAX] = { 0, };
+	ngram_v_t *vs[NGRAM_PACKED_MAX] = { NULL, };
+	t.s = calloc(t.mask + 1, sizeof *t.s);
+	if (!root || !(t.s))
+		goto fail;
+	uint64_t w = 0;
+	size_t i = 0;
+	for (int ch = 0; (ch = ngram_get(io)) != -1; i++) {
+		w = (w << 8) | ch;
+		if (i < (size_t)max - 1) {
+			first[i] = ch;
+			continue;
+		}
+		if (dense)
+			t.s[w & mask].cnt++;
+		else if (ngram_table_add(&t, w & mask) < 0)
+			goto fail;
+	}
+	size_t l = 0;
+	for (size_t j = 0; j <= t.mask; j++) {
+		if (!(t.s[j].cnt))
+			continue;
+		t.s[l] = t.s[j];
+		if (dense)
+			t.s[l].key = j;
+		l++;
+	}
+	if (!dense)
+		qsort(t.s, l, sizeof *t.s, ngram_compare_slot);
+	if (ngram_build(root, t.s, l, max) < 0)
+		goto fail;
+	const size_t shorter = NGRAM_MIN(i, (size_t)max - 1);
+	for (size_t j = 0; j < shorter; j++) {
+		if (!(vs[j] = malloc(sizeof *vs[j] + 1)))
+			goto fail;
+		vs[j]->l = 1;
+		vs[j]->m[0] = first[j];
+	}
+	for (size_t j = 0; j < shorter; j++)
+		if (ngram_add(root, vs, j + 1, 1) < 0)
+			goto fail;
+	for (size_t j = 0; j < shorter; j++)
+		free(vs[j]);
+	free(t.s);
+	return root;
+fail:
+	for (size_t j = 0; j < NGRAM_PACKED_MAX; j++)
+		free(vs[j]);
+	free(t.s);
+	ngram_unmk(root);
+	return NULL;
+}
+
+ngram_t *ngram_sized(ngram_io_t *io, const int max, const uint8_t *delimiters, const size_t length, const double *estimates) {
+	assert(io);
+	if (max <= 0 || (NGRAM_MAX_N > 0 && max > NGRAM_MAX_N))
+		return NULL;
+	const size_t hint = estimates && max <= NGRAM_PACKED_MAX ? (size_t)estimates[max - 1] : 0;
+#if NGRAM_BYTE_MODE < 0
+	if (!delimiters && length == 1)
+		return max <= NGRAM_PACKED_MAX ? ngram_packed(io, max, hint) : ngram_generate(io, max, NULL, 1, 1);
+	if (!delimiters)
+		return ngram_generate(io, max, NULL, length, 1);
+	return ngram_generate(io, max, delimiters, length, 0);
+#else
+	if (NGRAM_BYTE_MODE != !delimiters)
+		return NULL;
+	if (NGRAM_BYTE_MODE && length == 1)
+		return max <= NGRAM_PACKED_MAX ? ngram_packed(io, max, hint) : ngram_generate(io, max, NULL, 1, 1);
+	return ngram_generate(io, max, delimiters, length, NGRAM_BYTE_MODE);
+#endif
+}
+
+ngram_t *ngram(ngram_io_t *io, const int max, const uint8_t *delimiters, const size_t length) {
+	return ngram_sized(io, max, delimiters, length, NULL);
+}
+
+/* Each length has a HyperLogLog sketch of 2^NGRAM_SKETCH_BITS registers, with a
+ * standard error of 1.04 / sqrt(2^NGRAM_SKETCH_BITS), about 1.6%. The n-grams
+ * hashed are the prefixes of the windows 'ngram_generate' adds, which are the
+ * nodes of the tree. A prefix's hash is made from the hash of the prefix
+ * one shorter and the hash of its last token, so each costs one mix. */
+#define NGRAM_SKETCH_BITS (12)
+
+static inline unsigned ngram_leading(uint64_t x) { /* 'x' must not be zero */
+	assert(x);
+#ifdef __GNUC__
+	return __builtin_clzll(x);
+#else
+	unsigned r = 0;
+	for (; !(x & 0x8000000000000000ull); x <<= 1)
+		r++;
+	return r;
+#endif
+}
+
+static double ngram_logarithm(double x) { /* natural, for x >= 1, avoiding libm */
+	assert(x >= 1.0);
+	int k = 0;
+	for (; x >= 2.0; x /= 2.0)
+		k++;
+	const double y = (x - 1.0) / (x + 1.0), y2 = y * y;
+	double r = 0, t = y;
+	for (int i = 1; i < 40; i += 2, t *= y2)
+		r += t / i;
+	return k * 0.69314718055994530942 + 2.0 * r;
+}
+
+static inline void ngram_sketch_add(uint8_t *registers, const uint64_t h) {
+	assert(registers);
+	const size_t i = h >> (64 - NGRAM_SKETCH_BITS);
+	const uint8_t rho = ngram_leading((h << NGRAM_SKETCH_BITS) | ((uint64_t)1 << (NGRAM_SKETCH_BITS - 1))) + 1;
+	if (registers[i] < rho)
+		registers[i] = rho;
+}
+
+static double ngram_sketch_estimate(const uint8_t *registers) {
+	assert(registers);
+	const double m = 1 << NGRAM_SKETCH_BITS, alpha = 0.7213 / (1.0 + 1.079 / m);
+	double sum = 0;
+	size_t zeros = 0;
+	for (size_t i = 0; i < (1u << NGRAM_SKETCH_BITS); i++) {
+		sum += 1.0 / (double)((uint64_t)1 << registers[i]);
+		zeros += !registers[i];
+	}
+	const double e = alpha * m * m / sum;
+	if (e <= 2.5 * m && zeros) /* use linear counting for small sets */
+		return m * ngram_logarithm(m / zeros);
+	return e;
+}
+
+int ngram_estimate(ngram_io_t *io, const int max, const uint8_t *delimiters, const size_t length, double *estimates, size_t *bytes) {
+	assert(io);
+	assert(estimates);
+	if (max <= 0 || (NGRAM_MAX_N > 0 && max > NGRAM_MAX_N))
+		return -1;
+#if NGRAM_BYTE_MODE >= 0
+	if (NGRAM_BYTE_MODE != !delimiters)
+		return -1;
+#endif
+	const int lmode = !delimiters;
+	uint8_t *registers = calloc((size_t)max << NGRAM_SKETCH_BITS, 1);
+	uint64_t *hs = calloc(max, sizeof *hs); /* hashes of the last 'max' tokens */
+	ngram_v_t *v = NULL;
+	size_t tokens = 0, total = 0;
+	if (!registers || !hs)
+		goto fail;
+	for (int j = 1;;j += j < max) {
+		if (ngram_token(io, &v, lmode, delimiters, length) < 0)
+			goto fail;
+		if (!v)
+			break;
+		uint64_t h = 0xcbf29ce484222325ull; /* FNV-1a */
+		for (size_t i = 0; i < v->l; i++)
+			h = (h ^ v->m[i]) * 0x100000001b3ull;
+		memmove(hs, hs + 1, (max - 1) * sizeof *hs);
+		hs[max - 1] = ngram_hash64(h ^ v->l);
+		tokens++;
+		total += v->l;
+		if (!lmode) { /* words are all different sizes */
+			free(v);
+			v = NULL;
+		}
+		h = 0;
+		for (int k = 0; k < j; k++) {
+			h = ngram_hash64((h * 0x9e3779b97f4a7c15ull) ^ hs[max - j + k]);
+			ngram_sketch_add(registers + ((size_t)k << NGRAM_SKETCH_BITS), h);
+		}
+	}
+	double nodes = 0;
+	for (int k = 0; k < max; k++)
+		nodes += estimates[k] = tokens ? ngram_sketch_estimate(registers + ((size_t)k << NGRAM_SKETCH_BITS)) : 0;
+	if (bytes) { /* a node, its token and its entry in its parents list */
+		const size_t each = sizeof (ngram_t) + (tokens ? (total + tokens - 1) / tokens : 0) + sizeof (ngram_t*);
+		double b = sizeof (ngram_t) + nodes * each;
+		if (lmode && length == 1 && max <= NGRAM_PACKED_MAX && max > 2) /* and the table */
+			b += estimates[max - 1] * 2 * sizeof (ngram_slot_t);
+		*bytes = b >= (double)SIZE_MAX ? SIZE_MAX : (size_t)b;
+	}
+	free(v);
+	free(hs);
+	free(registers);
+	return 0;
+fail:
+	free(v);
+	free(hs);
+	free(registers);
+	return -1;
+}
+
+/* The batch engine reads all of the input and sorts the offsets of every
+ * window of 'max' bytes by the bytes in it, with a most significant byte
+ * first radix sort. The first pass, on the first byte, is split between
+ * threads, each histogramming and scattering its own part of the input,
+ * the buckets it produces are then sorted by whichever thread is free.
+ * Small buckets are finished with an insertion sort. The first max - 1
+ * windows are only prefixes of the input (see 'ngram_generate') and are merged
+ * into the sorted windows whilst scanning them.
+ *
+ * Every n-gram is a prefix shared by a run of the sorted windows, so one
+ * scan, keeping a count per depth, finds them in the order 'ngram_print_line'
+ * prints them in; deeper n-grams first, then by byte. When a window
+ * shares less of a prefix with the previous one, the n-grams of the
+ * previous window deeper than that are complete, they are printed and
+ * their counts added to their parents. */
+#define NGRAM_SORT_SMALL (32)
+
+typedef struct {
+	const uint8_t *t;
+	size_t *a, *tmp;  /* 'a' holds the windows sorted on the first byte */
+	size_t start[257]; /* buckets in 'a', by first byte */
+	size_t next;       /* next bucket to sort */
+	int max;
+#if NGRAM_THREADS
+	pthread_mutex_t lock;
+#endif
+} ngram_sorter_t;
+
+typedef struct {
+	ngram_sorter_t *s;
+	size_t lo, hi, at[256]; /* windows [lo, hi), histogram then positions */
+	int phase;
+} ngram_sort_job_t;
+
+static void ngram_insertion(const uint8_t *t, size_t *a, const size_t n, const int depth, const int max) {
+	assert(t);
+	assert(a);
+	for (size_t i = 1; i < n; i++) {
+		const size_t x = a[i];
+		size_t j = i;
+		for (; j > 0 && memcmp(t + a[j - 1] + depth, t + x + depth, max - depth) > 0; j--)
+			a[j] = a[j - 1];
+		a[j] = x;
+	}
+}
+
+static void ngram_radix(const uint8_t *t, size_t *a, size_t *tmp, const size_t n, int depth, const int max) {
+	assert(t);
+	assert(a);
+	assert(tmp);
+	for (; depth < max; depth++) {
+		if (n < NGRAM_SORT_SMALL) {
+			ngram_insertion(t, a, n, depth, max);
+			return;
+		}
+		size_t cnt[256] = { 0, }, at[256];
+		for (size_t i = 0; i < n; i++)
+			cnt[t[a[i] + depth]]++;
+		if (cnt[t[a[0] + depth]] == n) /* all in one bucket */
+			continue;
+		for (size_t b = 0, sum = 0; b < 256; sum += cnt[b++])
+			at[b] = sum;
+		for (size_t i = 0; i < n; i++)
+			tmp[at[t[a[i] + depth]]++] = a[i];
+		memcpy(a, tmp, n * sizeof *a);
+		for (size_t b = 0, sum = 0; b < 256; sum += cnt[b++])
+			if (cnt[b] > 1)
+				ngram_radix(t, a + sum, tmp + sum, cnt[b], depth + 1, max);
+		return;
+	}
+}
+
+static void *ngram_sort_worker(void *arg) {
+	assert(arg);
+	ngram_sort_job_t *j = arg;
+	ngram_sorter_t *s = j->s;
+	switch (j->phase) {
+	case 0:
+		memset(j->at, 0, sizeof j->at);
+		for (size_t i = j->lo; i < j->hi; i++)
+			j->at[s->t[i]]++;
+		break;
+	case 1:
+		for (size_t i = j->lo; i < j->hi; i++)
+			s->a[j->at[s->t[i]]++] = i;
+		break;
+	case 2:
+		for (;;) {
+#if NGRAM_THREADS
+			pthread_mutex_lock(&s->lock);
+#endif
+			const size_t b = s->next++;
+#if NGRAM_THREADS
+			pthread_mutex_unlock(&s->lock);
+#endif
+			if (b >= 256)
+				break;
+			const size_t lo = s->start[b], n = s->start[b + 1] - lo;
+			if (n > 1)
+				ngram_radix(s->t, s->a + lo, s->tmp + lo, n, 1, s->max);
+		}
+		break;
+	}
+	return NULL;
+}
+
+static int ngram_sort_phase(ngram_sort_job_t *jobs, const int threads, const int phase) {
+	assert(jobs);
+	assert(threads >= 1);
+	for (int i = 0; i < threads; i++)
+		jobs[i].phase = phase;
+#if NGRAM_THREADS
+	pthread_t *ts = threads > 1 ? calloc(threads, sizeof *ts) : NULL;
+	int started = 1;
+	if (ts)
+		for (; started < threads; started++)
+			if (pthread_create(&ts[started], NULL, ngram_sort_worker, &jobs[started]))
+				break;
+	ngram_sort_worker(&jobs[0]);
+	for (int i = 1; i < started; i++)
+		pthread_join(ts[i], NULL);
+	free(ts);
+	for (int i = started; i < threads; i++) /* could not start these */
+		ngram_sort_worker(&jobs[i]);
+#else
+	for (int i = 0; i < threads; i++)
+		ngram_sort_worker(&jobs[i]);
+#endif
+	return 0;
+}
+
+static int ngram_sorted(const uint8_t *t, size_t *a, size_t *tmp, const size_t n, const int max, int threads) {
+	assert(t);
+	assert(a);
+	assert(tmp);
+	ngram_sorter_t s = { .t = t, .a = a, .tmp = tmp, .max = max, };
+	threads = NGRAM_THREADS ? (int)NGRAM_MIN((size_t)NGRAM_MAX(threads, 1), n / 65536 + 1) : 1;
+	ngram_sort_job_t *jobs = calloc(threads, sizeof *jobs);
+	if (!jobs)
+		return -1;
+#if NGRAM_THREADS
+	if (pthread_mutex_init(&s.lock, NULL)) {
+		free(jobs);
+		return -1;
+	}
+#endif
+	for (int i = 0; i < threads; i++) {
+		jobs[i].s = &s;
+		jobs[i].lo = n / threads * i;
+		jobs[i].hi = i == threads - 1 ? n : n / threads * (i + 1);
+	}
+	ngram_sort_phase(jobs, threads, 0);
+	size_t sum = 0;
+	for (size_t b = 0; b < 256; b++) {
+		s.start[b] = sum;
+		for (int i = 0; i < threads; i++) {
+			const size_t c = jobs[i].at[b];
+			jobs[i].at[b] = sum;
+			sum += c;
+		}
+	}
+	s.start[256] = sum;
+	ngram_sort_phase(jobs, threads, 1);
+	ngram_sort_phase(jobs, threads, 2);
+#if NGRAM_THREADS
+	pthread_mutex_destroy(&s.lock);
+#endif
+	free(jobs);
+	return 0;
+}
+
+static int ngram_emit(const uint8_t *m, const int depth, const size_t cnt, ngram_io_t *io, const ngram_print_t *p) {
+	assert(m);
+	assert(io);
+	assert(p);
+	if (depth < p->min)
+		return 0;
+	char buf[32] = { 0 };
+	if (snprintf(buf, sizeof buf, "%u%c", (unsigned)cnt, p->sep) < 0)
+		return -1;
+	if (ngram_sput(buf, io) < 0)
+		return -1;
+	if (p->merge && ngram_put('"', io) < 0)
+		return -1;
+	for (int i = 0; i < depth; i++)
+		if (ngram_output(0, 0, p, m + i, 1, io) < 0)
+			return -1;
+	if (p->merge && ngram_put('"', io) < 0)
+		return -1;
+	return ngram_put('\n', io) < 0 ? -1 : 0;
+}
+
+/* print the n-grams in 'm' deeper than 'depth' */
+static int ngram_complete(const uint8_t *m, int l, const int depth, size_t *cnt, ngram_io_t *io, const ngram_print_t *p) {
+	assert(cnt);
+	for (; l > depth; l--) {
+		if (ngram_emit(m, l, cnt[l], io, p) < 0)
+			return -1;
+		cnt[l - 1] += cnt[l];
+		cnt[l] = 0;
+	}
+	return 0;
+}
+
+int ngram_batch(ngram_io_t *io, const int max, const ngram_print_t *p) {
+	assert(io);
+	assert(p);
+	if (!NGRAM_BYTE_MODE || max <= 0 || (NGRAM_MAX_N > 0 && max > NGRAM_MAX_N) || p->tree)
+		return -1;
+	uint8_t *t = NULL;
+	size_t *a = NULL, *tmp = NULL, *cnt = NULL, l = 0, sz = 0;
+	for (int ch = 0; (ch = ngram_get(io)) != -1; t[l++] = ch) {
+		if (l >= sz) {
+			sz = sz ? sz * 2 : 4096;
+			uint8_t *n = realloc(t, sz);
+			if (!n)
+				goto fail;
+			t = n;
+		}
+	}
+	const size_t n = l >= (size_t)max ? l - max + 1 : 0, shorts = NGRAM_MIN((size_t)max - 1, l);
+	a = malloc((n + 1) * sizeof *a);
+	tmp = malloc((n + 1) * sizeof *tmp);
+	cnt = calloc(max + 1, sizeof *cnt);
+	if (!a || !tmp || !cnt)
+		goto fail;
+	if (n && ngram_sorted(t, a, tmp, n, max, p->threads) < 0)
+		goto fail;
+	const uint8_t *last = NULL;
+	int ll = 0;
+	for (size_t i = 0, k = 1;;) {
+		const uint8_t *m = NULL;
+		int ml = max;
+		if (k <= shorts && (i >= n || memcmp(t, t + a[i], k) <= 0)) {
+			m = t;
+			ml = k++;
+		} else if (i < n) {
+			m = t + a[i++];
+		} else {
+			break;
+		}
+		int common = 0;
+		for (const int c = NGRAM_MIN(ml, ll); common < c && m[common] == last[common];)
+			common++;
+		if (ngram_complete(last, ll, common, cnt, io, p) < 0)
+			goto fail;
+		cnt[ml]++;
+		last = m;
+		ll = ml;
+	}
+	if (ngram_complete(last, ll, 0, cnt, io, p) < 0)
+		goto fail;
+	free(t);
+	free(a);
+	free(tmp);
+	free(cnt);
+	return 0;
+fail:
+	free(t);
+	free(a);
+	free(tmp);
+	free(cnt);
+	return -1;
+}
+
+static ngram_t *ngram_copy(const ngram_t *n, ngram_t *parent) {
+	assert(n);
+	ngram_t *c = calloc(1, sizeof *c + n->ml);
+	if (!c)
+		return NULL;
+	memcpy(c->m, n->m, n->ml);
+	c->ml = n->ml;
+	c->cnt = n->cnt;
+	c->parent = parent;
+	if (n->nl && !(c->ns = calloc(n->nl, sizeof *c->ns))) {
+		free(c);
+		return NULL;
+	}
+	for (size_t i = 0; i < n->nl; i++, c->nl++) {
+		if (!(c->ns[i] = ngram_copy(n->ns[i], c))) {
+			ngram_unmk(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+/* The shared model: lookups do not take locks. The children of each node
+ * are guarded by one of NGRAM_SHARED_STRIPES sequence locks, chosen by the nodes
+ * address, a reader retries if the sequence number changed under it. A
+ * writer inserting a child takes the mutex of the stripe. Children arrays
+ * are sized to the next power of two, and when full are replaced instead
+ * of reallocated, the old array being kept until no reader can see it
+ * (the next snapshot). Counts are incremented atomically.
+ *
+ * Feeders read a batch of tokens and then hold a gate open while adding
+ * them, a snapshot closes the gate and waits for it to empty before making
+ * a copy of the tree. */
+#define NGRAM_SHARED_BATCH   (4096)
+#define NGRAM_SHARED_STRIPES (1024)
+
+#if NGRAM_ATOMICS
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned long seq; /* odd whilst the children of a node are changing */
+} ngram_stripe_t;
+
+struct ngram_shared {
+	ngram_t *root;
+	ngram_stripe_t stripes[NGRAM_SHARED_STRIPES];
+	pthread_mutex_t gate;
+	pthread_cond_t changed;
+	size_t active;   /* feeders in the gate */
+	int pending;     /* snapshot waiting for the gate to empty */
+	void **retired;  /* replaced children arrays, freed on the next snapshot */
+	size_t retired_l, retired_sz;
+};
+
+static ngram_stripe_t *ngram_stripe(ngram_shared_t *s, const ngram_t *n) {
+	assert(s);
+	assert(n);
+	const uint64_t h = ((uint64_t)(uintptr_t)n >> 4) * 0x9E3779B97F4A7C15ull;
+	return &s->stripes[(h >> 32) % NGRAM_SHARED_STRIPES];
+}
+
+static ngram_t *ngram_shared_find(ngram_shared_t *s, ngram_t *n, ngram_v_t *v) {
+	assert(s);
+	assert(n);
+	assert(v);
+	ngram_stripe_t *t = ngram_stripe(s, n);
+	for (;;) {
+		const unsigned long seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		const size_t nl = __atomic_load_n(&n->nl, __ATOMIC_ACQUIRE);
+		ngram_t **ns = __atomic_load_n(&n->ns, __ATOMIC_ACQUIRE);
+		ngram_t *f = NULL;
+		long l = 0, r = (long)nl - 1;
+		while (r >= l) { /* same search as 'ngram_find' */
+			const long m = l + (r - l) / 2;
+			ngram_t *chld = __atomic_load_n(&ns[m], __ATOMIC_ACQUIRE);
+			const int k = ngram_compare(chld->m, v->m, NGRAM_MIN(chld->ml, v->l));
+			if (!k && chld->ml == v->l) {
+				f = chld;
+				break;
+			}
+			if (k > 0)
+				r = m - 1;
+			else
+				l = m + 1;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) == seq)
+			return f;
+	}
+}
+
+static int ngram_retire(ngram_shared_t *s, void *p) {
+	assert(s);
+	if (!p)
+		return 0;
+	int r = 0;
+	pthread_mutex_lock(&s->gate);
+	if (s->retired_l >= s->retired_sz) {
+		const size_t sz = s->retired_sz ? s->retired_sz * 2 : 64;
+		void **n = realloc(s->retired, sz * sizeof *n);
+		if (n) {
+			s->retired = n;
+			s->retired_sz = sz;
+		}
+	}
+	if (s->retired_l < s->retired_sz)
+		s->retired[s->retired_l++] = p;
+	else
+		r = -1;
+	pthread_mutex_unlock(&s->gate);
+	return r;
+}
+
+static ngram_t *ngram_shared_insert(ngram_shared_t *s, ngram_t *n, ngram_v_t *v) {
+	assert(s);
+	assert(n);
+	assert(v);
+	ngram_stripe_t *t = ngram_stripe(s, n);
+	pthread_mutex_lock(&t->lock);
+	ngram_t *f = ngram_find(n, v, 0); /* another thread may have beaten us to it */
+	if (f || !(f = ngram_mk(v)))
+		goto done;
+	f->parent = n;
+	const size_t i = ngram_position(n, f), nl = n->nl;
+	ngram_t **ns = n->ns, **fresh = NULL;
+	if (!(nl & (nl - 1))) { /* full, the capacity is the next power of two */
+		if (!(fresh = malloc((nl ? nl * 2 : 1) * sizeof *fresh)) || ngram_retire(s, ns) < 0) {
+			free(fresh);
+			free(f);
+			f = NULL;
+			goto done;
+		}
+		if (nl) {
+			memcpy(fresh, ns, i * sizeof *ns);
+			memcpy(fresh + i + 1, ns + i, (nl - i) * sizeof *ns);
+		}
+		fresh[i] = f;
+	}
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (fresh) {
+		__atomic_store_n(&n->ns, fresh, __ATOMIC_RELEASE);
+	} else {
+		for (size_t j = nl; j > i; j--)
+			__atomic_store_n(&ns[j], ns[j - 1], __ATOMIC_RELEASE);
+		__atomic_store_n(&ns[i], f, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&n->nl, nl + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+done:
+	pthread_mutex_unlock(&t->lock);
+	return f;
+}
+
+static void ngram_shared_count(ngram_t *n) {
+	assert(n);
+	__atomic_fetch_add(&n->cnt, 1, __ATOMIC_RELAXED);
+}
+
+static void ngram_gate_enter(ngram_shared_t *s) {
+	assert(s);
+	pthread_mutex_lock(&s->gate);
+	while (s->pending)
+		pthread_cond_wait(&s->changed, &s->gate);
+	s->active++;
+	pthread_mutex_unlock(&s->gate);
+}
+
+static void ngram_gate_leave(ngram_shared_t *s) {
+	assert(s);
+	pthread_mutex_lock(&s->gate);
+	if (!--(s->active))
+		pthread_cond_broadcast(&s->changed);
+	pthread_mutex_unlock(&s->gate);
+}
+
+ngram_shared_t *ngram_shared(void) {
+	ngram_shared_t *s = calloc(1, sizeof *s);
+	if (!s)
+		return NULL;
+	if (!(s->root = calloc(1, sizeof *s->root)))
+		goto fail;
+	if (pthread_mutex_init(&s->gate, NULL))
+		goto fail;
+	if (pthread_cond_init(&s->changed, NULL)) {
+		pthread_mutex_destroy(&s->gate);
+		goto fail;
+	}
+	for (size_t i = 0; i < NGRAM_SHARED_STRIPES; i++) {
+		if (pthread_mutex_init(&s->stripes[i].lock, NULL)) {
+			while (i--)
+				pthread_mutex_destroy(&s->stripes[i].lock);
+			pthread_cond_destroy(&s->changed);
+			pthread_mutex_destroy(&s->gate);
+			goto fail;
+		}
+	}
+	return s;
+fail:
+	free(s->root);
+	free(s);
+	return NULL;
+}
+
+ngram_t *ngram_shared_snapshot(ngram_shared_t *s) {
+	assert(s);
+	pthread_mutex_lock(&s->gate);
+	while (s->pending)
+		pthread_cond_wait(&s->changed, &s->gate);
+	s->pending = 1;
+	while (s->active)
+		pthread_cond_wait(&s->changed, &s->gate);
+	pthread_mutex_unlock(&s->gate);
+	ngram_t *c = ngram_copy(s->root, NULL);
+	for (size_t i = 0; i < s->retired_l; i++)
+		free(s->retired[i]);
+	s->retired_l = 0;
+	pthread_mutex_lock(&s->gate);
+	s->pending = 0;
+	pthread_cond_broadcast(&s->changed);
+	pthread_mutex_unlock(&s->gate);
+	return c;
+}
+
+int ngram_shared_free(ngram_shared_t *s) {
+	if (!s)
+		return 0;
+	for (size_t i = 0; i < NGRAM_SHARED_STRIPES; i++)
+		pthread_mutex_destroy(&s->stripes[i].lock);
+	pthread_cond_destroy(&s->changed);
+	pthread_mutex_destroy(&s->gate);
+	for (size_t i = 0; i < s->retired_l; i++)
+		free(s->retired[i]);
+	free(s->retired);
+	ngram_unmk(s->root);
+	free(s);
+	return 0;
+}
+#else
+/* Without atomics feeding threads take turns, each holding 'lock' for a
+ * whole batch of tokens. */
+struct ngram_shared {
+	ngram_t *root;
+#if NGRAM_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+static ngram_t *ngram_shared_find(ngram_shared_t *s, ngram_t *n, ngram_v_t *v) {
+	assert(s);
+	return ngram_find(n, v, 0);
+}
+
+static ngram_t *ngram_shared_insert(ngram_shared_t *s, ngram_t *n, ngram_v_t *v) {
+	assert(s);
+	ngram_t *f = ngram_mk(v);
+	if (!f)
+		return NULL;
+	if (ngram_grow(n, f) < 0) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+static void ngram_shared_count(ngram_t *n) {
+	assert(n);
+	n->cnt++;
+}
+
+static void ngram_gate_enter(ngram_shared_t *s) {
+	assert(s);
+#if NGRAM_THREADS
+	pthread_mutex_lock(&s->lock);
+#endif
+}
+
+static void ngram_gate_leave(ngram_shared_t *s) {
+	assert(s);
+#if NGRAM_THREADS
+	pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+ngram_shared_t *ngram_shared(void) {
+	ngram_shared_t *s = calloc(1, sizeof *s);
+	if (!s)
+		return NULL;
+	if (!(s->root = calloc(1, sizeof *s->root))) {
+		free(s);
+		return NULL;
+	}
+#if NGRAM_THREADS
+	if (pthread_mutex_init(&s->lock, NULL)) {
+		free(s->root);
+		free(s);
+		return NULL;
+	}
+#endif
+	return s;
+}
+
+ngram_t *ngram_shared_snapshot(ngram_shared_t *s) {
+	assert(s);
+	ngram_gate_enter(s);
+	ngram_t *c = ngram_copy(s->root, NULL);
+	ngram_gate_leave(s);
+	return c;
+}
+
+int ngram_shared_free(ngram_shared_t *s) {
+	if (!s)
+		return 0;
+#if NGRAM_THREADS
+	pthread_mutex_destroy(&s->lock);
+#endif
+	ngram_unmk(s->root);
+	free(s);
+	return 0;
+}
+#endif
+
+static int ngram_shared_add(ngram_shared_t *s, ngram_v_t **vs, size_t vl) {
+	assert(s);
+	assert(vs);
+	ngram_t *n = s->root;
+	for (size_t i = 0; i < vl; i++) {
+		ngram_t *f = ngram_shared_find(s, n, vs[i]);
+		if (!f && !(f = ngram_shared_insert(s, n, vs[i])))
+			return -1;
+		ngram_shared_count(f);
+		n = f;
+	}
+	return 0;
+}
+
+int ngram_shared_feed(ngram_shared_t *s, ngram_io_t *io, const int max, const uint8_t *delimiters, const size_t length) {
+	assert(s);
+	assert(io);
+	if (max <= 0)
+		return -1;
+	/* tokens are read outside of the gate, the last 'max - 1' tokens are
+	 * carried over to the next batch to complete the window */
+	const size_t cap = max - 1 + NGRAM_SHARED_BATCH;
+	ngram_v_t **ts = calloc(cap, sizeof *ts);
+	if (!ts)
+		return -1;
+	size_t have = 0, seen = 0;
+	int r = 0;
+	for (int eof = 0; !eof && r >= 0;) {
+		const size_t fresh = have;
+		while (have < cap) {
+			ngram_v_t *v = NULL;
+			if (ngram_token(io, &v, !delimiters, delimiters, length) < 0) {
+				r = -1;
+				break;
+			}
+			if (!v) {
+				eof = 1;
+				break;
+			}
+			ts[have++] = v;
+		}
+		ngram_gate_enter(s);
+		for (size_t k = fresh; r >= 0 && k < have; k++) {
+			seen++;
+			const size_t j = NGRAM_MIN(seen, (size_t)max);
+			r = ngram_shared_add(s, ts + k + 1 - j, j);
+		}
+		ngram_gate_leave(s);
+		const size_t keep = NGRAM_MIN(have, (size_t)max - 1);
+		for (size_t k = 0; k < have - keep; k++)
+			free(ts[k]);
+		memmove(ts, ts + have - keep, keep * sizeof *ts);
+		have = keep;
+	}
+	for (size_t k = 0; k < have; k++)
+		free(ts[k]);
+	free(ts);
+	return r;
+}
+
+/* Windowed counting keeps a tree per epoch in a ring. Adding a token only
+ * touches the tree of the current epoch, when that fills up it replaces
+ * the oldest tree in the ring, which is freed in one go. Decay is applied
+ * lazily, only when a snapshot merges the epochs together, n-grams whose
+ * weighted count rounds to zero are left out of it (as a child can never
+ * have a higher count than its parent, neither are their children).
+ * A snapshot only holds the lock to take the epochs it merges, an epoch
+ * that expires whilst snapshots are merging is retired and freed by the
+ * last of them instead. */
+struct ngram_window {
+	ngram_t **ring;      /* completed epochs, the newest at 'newest' */
+	ngram_t *current;    /* epoch being added to */
+	ngram_v_t **ls;            /* last 'max' tokens, carried across epochs */
+	uint8_t *delimiters; /* NULL for splitting into 'length' bytes */
+	size_t length, epoch, fill, seen;
+	int max, epochs, newest, completed;
+	int readers;         /* snapshots merging */
+	ngram_t *retired;    /* expired epochs in use, chained by 'parent' */
+	double decay;
+#if NGRAM_THREADS
+	pthread_mutex_t lock; /* guards all of the above but 'current' */
+#endif
+};
+
+typedef struct {
+	ngram_v_t *v;
+	size_t sz;
+} ngram_scratch_t;
+
+static void ngram_window_lock(ngram_window_t *w) {
+	assert(w);
+#if NGRAM_THREADS
+	pthread_mutex_lock(&w->lock);
+#endif
+}
+
+static void ngram_window_unlock(ngram_window_t *w) {
+	assert(w);
+#if NGRAM_THREADS
+	pthread_mutex_unlock(&w->lock);
+#endif
+}
+
+ngram_window_t *ngram_window(const int max, const uint8_t *delimiters, const size_t length, const size_t epoch, const int epochs, const double decay) {
+	if (max <= 0 || epoch == 0 || epochs <= 0 || !(decay >= 0.0 && decay <= 1.0))
+		return NULL;
+	ngram_window_t *w = calloc(1, sizeof *w);
+	if (!w)
+		return NULL;
+	w->max = max;
+	w->length = length;
+	w->epoch = epoch;
+	w->epochs = epochs;
+	w->decay = decay;
+	w->ring = calloc(epochs, sizeof *w->ring);
+	w->ls = calloc(max, sizeof *w->ls);
+	w->current = calloc(1, sizeof *w->current);
+	if (delimiters && (w->delimiters = malloc(length + 1)))
+		memcpy(w->delimiters, delimiters, length);
+	if (!w->ring || !w->ls || !w->current || (delimiters && !w->delimiters))
+		goto fail;
+#if NGRAM_THREADS
+	if (pthread_mutex_init(&w->lock, NULL))
+		goto fail;
+#endif
+	return w;
+fail:
+	free(w->ring);
+	free(w->ls);
+	free(w->current);
+	free(w->delimiters);
+	free(w);
+	return NULL;
+}
+
+int ngram_window_free(ngram_window_t *w) {
+	if (!w)
+		return 0;
+	for (int i = 0; i < w->epochs; i++)
+		ngram_unmk(w->ring[i]);
+	for (ngram_t *n = w->retired, *next = NULL; n; n = next) {
+		next = n->parent;
+		ngram_unmk(n);
+	}
+	for (int i = 0; i < w->max; i++)
+		free(w->ls[i]);
+#if NGRAM_THREADS
+	pthread_mutex_destroy(&w->lock);
+#endif
+	ngram_unmk(w->current);
+	free(w->ring);
+	free(w->ls);
+	free(w->delimiters);
+	free(w);
+	return 0;
+}
+
+static int ngram_rotate(ngram_window_t *w) {
+	assert(w);
+	ngram_t *fresh = calloc(1, sizeof *fresh);
+	if (!fresh)
+		return -1;
+	ngram_window_lock(w);
+	w->newest = (w->newest + 1) % w->epochs;
+	ngram_t *oldest = w->ring[w->newest];
+	w->ring[w->newest] = w->current;
+	w->completed += w->completed < w->epochs;
+	if (oldest && w->readers) { /* a snapshot may be merging it */
+		oldest->parent = w->retired;
+		w->retired = oldest;
+		oldest = NULL;
+	}
+	ngram_window_unlock(w);
+	ngram_unmk(oldest);
+	w->current = fresh;
+	w->fill = 0;
+	return 0;
+}
+
+int ngram_window_feed(ngram_window_t *w, ngram_io_t *io) {
+	assert(w);
+	assert(io);
+	const int max = w->max, lmode = !(w->delimiters);
+	while (w->fill < w->epoch) {
+		ngram_v_t *v = NULL;
+		if (lmode && w->seen == (size_t)max) { /* recycle the oldest */
+			v = w->ls[0];
+			w->ls[0] = NULL;
+		}
+		if (ngram_token(io, &v, lmode, w->delimiters, w->length) < 0)
+			return -1;
+		if (!v) { /* end of input completes a partial epoch */
+			if (!w->fill)
+				return 0;
+			return ngram_rotate(w) < 0 ? -1 : 1;
+		}
+		free(w->ls[0]);
+		memmove(w->ls, w->ls + 1, (max - 1) * sizeof *w->ls);
+		w->ls[max - 1] = v;
+		w->seen += w->seen < (size_t)max;
+		if (ngram_add(w->current, w->ls + (max - w->seen), w->seen, lmode && w->length == 1) < 0)
+			return -1;
+		w->fill++;
+	}
+	return ngram_rotate(w) < 0 ? -1 : 1;
+}
+
+static int ngram_merge(ngram_t *dst, const ngram_t *src, const double weight, ngram_scratch_t *s) {
+	assert(dst);
+	assert(src);
+	assert(s);
+	for (size_t i = 0; i < src->nl; i++) {
+		const ngram_t *c = src->ns[i];
+		const size_t cnt = weight == 1.0 ? c->cnt : (size_t)(c->cnt * weight + 0.5);
+		if (!cnt)
+			continue;
+		if (s->sz < c->ml) {
+			ngram_v_t *v = realloc(s->v, sizeof *v + c->ml);
+			if (!v)
+				return -1;
+			s->v = v;
+			s->sz = c->ml;
+		}
+		s->v->l = c->ml;
+		memcpy(s->v->m, c->m, c->ml);
+		ngram_t *d = ngram_find(dst, s->v, 0);
+		if (!d) {
+			if (!(d = ngram_mk(s->v)))
+				return -1;
+			if (ngram_grow(dst, d) < 0) {
+				free(d);
+				return -1;
+			}
+		}
+		d->cnt += cnt;
+		if (ngram_merge(d, c, weight, s) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+ngram_t *ngram_window_snapshot(ngram_window_t *w) {
+	assert(w);
+	ngram_t *root = NULL, **epochs = calloc(w->epochs, sizeof *epochs);
+	ngram_scratch_t s = { .v = NULL, };
+	if (!epochs)
+		return NULL;
+	ngram_window_lock(w);
+	const int completed = w->completed;
+	for (int age = 0; age < completed; age++)
+		epochs[age] = w->ring[(w->newest - age + w->epochs) % w->epochs];
+	w->readers++;
+	ngram_window_unlock(w);
+	/* the newest epoch is copied, keeping the order of its children */
+	int r = (root = completed ? ngram_copy(epochs[0], NULL) : calloc(1, sizeof *root)) ? 0 : -1;
+	double weight = w->decay;
+	for (int age = 1; r >= 0 && age < completed; age++, weight *= w->decay)
+		r = ngram_merge(root, epochs[age], weight, &s);
+	ngram_window_lock(w);
+	ngram_t *retired = NULL;
+	if (!--w->readers) {
+		retired = w->retired;
+		w->retired = NULL;
+	}
+	ngram_window_unlock(w);
+	for (ngram_t *next = NULL; retired; retired = next) {
+		next = retired->parent;
+		ngram_unmk(retired);
+	}
+	free(s.v);
+	free(epochs);
+	if (r < 0) {
+		ngram_unmk(root);
+		return NULL;
+	}
+	return root;
+}
+
+static int ngram_print_serial(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p) {
+	assert(io);
+	assert(p);
+	return p->tree ? ngram_print_tree(n, io, p, 0) : ngram_print_line(n, io, p, 0);
+}
+
+#if NGRAM_THREADS
+/* The output is partitioned by the children of the root node, each child
+ * being formatted into its own buffer by a worker, the buffers are then
+ * written out in order by the calling thread. Workers are only allowed to
+ * get 'window' partitions ahead of the writer to bound memory usage. */
+typedef struct {
+	const ngram_t *n;
+	const ngram_print_t *p;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ngram_buffer_t *bufs;
+	int *result;
+	unsigned char *done;
+	size_t next, written, window;
+	int error;
+} ngram_partition_t;
+
+static void *ngram_print_worker(void *arg) {
+	assert(arg);
+	ngram_partition_t *t = arg;
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		while (!t->error && t->next < t->n->nl && t->next >= t->written + t->window)
+			pthread_cond_wait(&t->cond, &t->lock);
+		if (t->error || t->next >= t->n->nl) {
+			pthread_mutex_unlock(&t->lock);
+			return NULL;
+		}
+		const size_t i = t->next++;
+		pthread_mutex_unlock(&t->lock);
+		ngram_io_t io = { .put = ngram_buffer_put, .out = &t->bufs[i], };
+		const int r = t->p->tree ?
+			ngram_print_tree(t->n->ns[i], &io, t->p, 0) :
+			ngram_print_line(t->n->ns[i], &io, t->p, 1);
+		pthread_mutex_lock(&t->lock);
+		t->result[i] = r;
+		t->done[i] = 1;
+		pthread_cond_broadcast(&t->cond);
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+static int ngram_print_parallel(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p) {
+	assert(n);
+	assert(io);
+	assert(p);
+	assert(n->ml == 0);
+	const size_t l = n->nl, threads = NGRAM_MIN((size_t)p->threads, l);
+	ngram_partition_t t = { .n = n, .p = p, .window = threads * 4, };
+	pthread_t *ts = calloc(threads, sizeof *ts);
+	t.bufs = calloc(l, sizeof *t.bufs);
+	t.result = calloc(l, sizeof *t.result);
+	t.done = calloc(l, sizeof *t.done);
+	size_t created = 0;
+	int r = p->tree ? 1 : 0;
+	if (!ts || !t.bufs || !t.result || !t.done)
+		goto serial;
+	if (pthread_mutex_init(&t.lock, NULL))
+		goto serial;
+	if (pthread_cond_init(&t.cond, NULL)) {
+		pthread_mutex_destroy(&t.lock);
+		goto serial;
+	}
+	for (; created < threads; created++)
+		if (pthread_create(&ts[created], NULL, ngram_print_worker, &t))
+			break;
+	if (!created) {
+		pthread_cond_destroy(&t.cond);
+		pthread_mutex_destroy(&t.lock);
+		goto serial;
+	}
+	for (size_t i = 0; i < l; i++) {
+		pthread_mutex_lock(&t.lock);
+		while (!t.done[i])
+			pthread_cond_wait(&t.cond, &t.lock);
+		pthread_mutex_unlock(&t.lock);
+		int k = t.result[i];
+		for (size_t j = 0; k >= 0 && j < t.bufs[i].l; j++)
+			if (ngram_put(t.bufs[i].b[j], io) < 0)
+				k = -1;
+		free(t.bufs[i].b);
+		t.bufs[i].b = NULL;
+		pthread_mutex_lock(&t.lock);
+		t.written = i + 1;
+		t.error = k < 0;
+		pthread_cond_broadcast(&t.cond);
+		pthread_mutex_unlock(&t.lock);
+		if (k < 0) {
+			r = -1;
+			break;
+		}
+		r += k;
+	}
+	for (size_t i = 0; i < created; i++)
+		pthread_join(ts[i], NULL);
+	pthread_cond_destroy(&t.cond);
+	pthread_mutex_destroy(&t.lock);
+	for (size_t i = 0; i < l; i++)
+		free(t.bufs[i].b);
+	free(t.bufs);
+	free(t.result);
+	free(t.done);
+	free(ts);
+	return r;
+serial:
+	free(t.bufs);
+	free(t.result);
+	free(t.done);
+	free(ts);
+	return ngram_print_serial(n, io, p);
+}
+#endif
+
+int ngram_print(const ngram_t *n, ngram_io_t *io, const ngram_print_t *p) {
+	assert(io);
+	assert(p);
+#if NGRAM_THREADS
+	if (n && p->threads > 1 && n->nl > 1 && !n->ml) /* only the root has nothing of its own to print */
+		return ngram_print_parallel(n, io, p);
+#endif
+	return ngram_print_serial(n, io, p);
+}
+
+/* A frozen tree is a level order unary degree sequence (LOUDS) bit vector,
+ * each node in level order (the root being node zero) contributes a one
+ * for each child followed by a zero. The children of node 'i' are the
+ * bits after the 'i-1'th zero and before the 'i'th, and are numbered from
+ * one more than the count of ones before them. Rank (ones before a
+ * position) and select (position of the k'th zero) are sped up with
+ * sampled directories. Counts and label lengths are stored as varints in
+ * level order, with the offset of every NGRAM_FROZEN_SAMPLE'th node kept, the
+ * labels themselves are concatenated into a pool. If all labels are the
+ * same length (as with splitting on bytes) their lengths are not stored. */
+#define NGRAM_FROZEN_SAMPLE (64)  /* nodes between offsets into varint streams */
+#define NGRAM_RANK_BLOCK    (512) /* bits between rank samples */
+#define NGRAM_SELECT_SAMPLE (256) /* zeros between select samples */
+
+struct ngram_frozen {
+	uint64_t *bits;    /* LOUDS bit vector */
+	size_t *ranks;     /* ones before each NGRAM_RANK_BLOCK */
+	size_t *zeros;     /* position of each NGRAM_SELECT_SAMPLE'th zero */
+	uint8_t *counts;   /* varint counts */
+	size_t *count_at;  /* offset into 'counts' of each NGRAM_FROZEN_SAMPLE'th node */
+	uint8_t *lengths;  /* varint label lengths, NULL if all labels are 'width' long */
+	size_t *label_at;  /* offset into 'lengths' and 'pool' of each NGRAM_FROZEN_SAMPLE'th node */
+	uint8_t *pool;     /* labels */
+	size_t nodes, nbits, width, height, bytes;
+};
+
+typedef struct {
+	size_t node, count, length, label; /* node and offsets of it in each stream */
+} ngram_cursor_t;
+
+static inline unsigned ngram_popcount(uint64_t x) {
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return (x * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+static size_t ngram_varint_length(size_t v) {
+	size_t r = 1;
+	for (; v >= 0x80; v >>= 7)
+		r++;
+	return r;
+}
+
+static size_t ngram_varint_put(uint8_t *b, size_t v) {
+	assert(b);
+	size_t r = 0;
+	for (; v >= 0x80; v >>= 7)
+		b[r++] = (v & 0x7F) | 0x80;
+	b[r++] = v;
+	return r;
+}
+
+static inline size_t ngram_varint_get(const uint8_t *b, size_t *at) {
+	assert(b);
+	assert(at);
+	size_t v = 0;
+	for (unsigned shift = 0;; shift += 7) {
+		const uint8_t c = b[(*at)++];
+		v |= (size_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return v;
+	}
+}
+
+static size_t ngram_rank1(const ngram_frozen_t *f, const size_t pos) {
+	assert(f);
+	size_t r = f->ranks[pos / NGRAM_RANK_BLOCK];
+	for (size_t w = (pos / NGRAM_RANK_BLOCK) * (NGRAM_RANK_BLOCK / 64); w < pos / 64; w++)
+		r += ngram_popcount(f->bits[w]);
+	if (pos % 64)
+		r += ngram_popcount(f->bits[pos / 64] & ((UINT64_C(1) << (pos % 64)) - 1));
+	return r;
+}
+
+static size_t ngram_select0(const ngram_frozen_t *f, size_t k) {
+	assert(f);
+	size_t pos = f->zeros[k / NGRAM_SELECT_SAMPLE];
+	k %= NGRAM_SELECT_SAMPLE;
+	if (!k)
+		return pos;
+	pos++; /* skip the sampled zero */
+	for (;;) {
+		const size_t w = pos / 64, left = 64 - pos % 64;
+		uint64_t z = ~(f->bits[w]) >> (pos % 64);
+		if (left < 64)
+			z &= (UINT64_C(1) << left) - 1;
+		const unsigned c = ngram_popcount(z);
+		if (k <= c) {
+			for (;; pos++, z >>= 1)
+				if ((z & 1) && !--k)
+					return pos;
+		}
+		k -= c;
+		pos += left;
+	}
+}
+
+/* children of node 'i' are nodes '*first' to '*first + return value - 1' */
+static size_t ngram_children(const ngram_frozen_t *f, const size_t i, size_t *first) {
+	assert(f);
+	assert(first);
+	const size_t start = i ? ngram_select0(f, i - 1) + 1 : 0, end = ngram_select0(f, i);
+	*first = ngram_rank1(f, start) + 1;
+	return end - start;
+}
+
+static void ngram_seek(const ngram_frozen_t *f, const size_t i, ngram_cursor_t *c) {
+	assert(f);
+	assert(c);
+	assert(i < f->nodes);
+	const size_t s = i / NGRAM_FROZEN_SAMPLE;
+	c->node = s * NGRAM_FROZEN_SAMPLE;
+	c->count = f->count_at[s];
+	c->length = f->label_at[s * 2];
+	c->label = f->label_at[s * 2 + 1];
+	for (; c->node < i; c->node++) {
+		(void)ngram_varint_get(f->counts, &c->count);
+		c->label += f->lengths ? ngram_varint_get(f->lengths, &c->length) : (c->node ? f->width : 0);
+	}
+}
+
+/* read the node under the cursor and move onto the next one */
+static const uint8_t *ngram_step(const ngram_frozen_t *f, ngram_cursor_t *c, size_t *cnt, size_t *l) {
+	assert(f);
+	assert(c);
+	assert(cnt);
+	assert(l);
+	*cnt = ngram_varint_get(f->counts, &c->count);
+	*l = f->lengths ? ngram_varint_get(f->lengths, &c->length) : (c->node ? f->width : 0);
+	const uint8_t *m = &f->pool[c->label];
+	c->label += *l;
+	c->node++;
+	return m;
+}
+
+static size_t ngram_nodes(const ngram_t *n, size_t depth, size_t *height, size_t *width, int *fixed) {
+	assert(n);
+	size_t r = 1;
+	*height = NGRAM_MAX(*height, depth);
+	if (n->ml) {
+		*fixed &= !*width || *width == n->ml;
+		*width = n->ml;
+	}
+	for (size_t i = 0; i < n->nl; i++)
+		r += ngram_nodes(n->ns[i], depth + 1, height, width, fixed);
+	return r;
+}
+
+ngram_frozen_t *ngram_freeze(const ngram_t *n) {
+	if (!n)
+		return NULL;
+	ngram_frozen_t *f = calloc(1, sizeof *f);
+	const ngram_t **q = NULL;
+	if (!f)
+		return NULL;
+	int fixed = 1;
+	f->nodes = ngram_nodes(n, 0, &f->height, &f->width, &fixed);
+	f->nbits = 2 * f->nodes - 1;
+	if (!(q = malloc(f->nodes * sizeof *q)))
+		goto fail;
+	q[0] = n;
+	size_t counts = 0, lengths = 0, pool = 0;
+	for (size_t head = 0, tail = 1; head < f->nodes; head++) { /* level order */
+		const ngram_t *m = q[head];
+		for (size_t i = 0; i < m->nl; i++)
+			q[tail++] = m->ns[i];
+		counts += ngram_varint_length(m->cnt);
+		lengths += ngram_varint_length(m->ml);
+		pool += m->ml;
+	}
+	const size_t words = (f->nbits + 63) / 64, blocks = f->nbits / NGRAM_RANK_BLOCK + 1;
+	const size_t samples = (f->nodes + NGRAM_FROZEN_SAMPLE - 1) / NGRAM_FROZEN_SAMPLE;
+	const size_t selects = (f->nodes + NGRAM_SELECT_SAMPLE - 1) / NGRAM_SELECT_SAMPLE;
+	f->bits = calloc(words, sizeof *f->bits);
+	f->ranks = malloc(blocks * sizeof *f->ranks);
+	f->zeros = malloc(selects * sizeof *f->zeros);
+	f->counts = malloc(counts);
+	f->count_at = malloc(samples * sizeof *f->count_at);
+	f->lengths = fixed ? NULL : malloc(lengths);
+	f->label_at = malloc(samples * 2 * sizeof *f->label_at);
+	f->pool = malloc(pool + 1);
+	if (!f->bits || !f->ranks || !f->zeros || !f->counts || !f->count_at || (!fixed && !f->lengths) || !f->label_at || !f->pool)
+		goto fail;
+	f->bytes = sizeof *f + words * sizeof *f->bits + blocks * sizeof *f->ranks
+		+ selects * sizeof *f->zeros + counts + samples * sizeof *f->count_at
+		+ (fixed ? 0 : lengths) + samples * 2 * sizeof *f->label_at + pool + 1;
+	size_t bit = 0, zero = 0;
+	counts = 0, lengths = 0, pool = 0;
+	for (size_t i = 0; i < f->nodes; i++) {
+		const ngram_t *m = q[i];
+		if (!(i % NGRAM_FROZEN_SAMPLE)) {
+			f->count_at[i / NGRAM_FROZEN_SAMPLE] = counts;
+			f->label_at[(i / NGRAM_FROZEN_SAMPLE) * 2] = lengths;
+			f->label_at[(i / NGRAM_FROZEN_SAMPLE) * 2 + 1] = pool;
+		}
+		for (size_t j = 0; j < m->nl; j++, bit++)
+			f->bits[bit / 64] |= UINT64_C(1) << (bit % 64);
+		if (!(zero % NGRAM_SELECT_SAMPLE))
+			f->zeros[zero / NGRAM_SELECT_SAMPLE] = bit;
+		zero++;
+		bit++;
+		counts += ngram_varint_put(&f->counts[counts], m->cnt);
+		if (!fixed)
+			lengths += ngram_varint_put(&f->lengths[lengths], m->ml);
+		memcpy(&f->pool[pool], m->m, m->ml);
+		pool += m->ml;
+	}
+	for (size_t b = 0, r = 0; b < blocks; b++) {
+		f->ranks[b] = r;
+		for (size_t w = b * (NGRAM_RANK_BLOCK / 64); w < words && w < (b + 1) * (NGRAM_RANK_BLOCK / 64); w++)
+			r += ngram_popcount(f->bits[w]);
+	}
+	free(q);
+	return f;
+fail:
+	free(q);
+	ngram_frozen_free(f);
+	return NULL;
+}
+
+int ngram_frozen_free(ngram_frozen_t *f) {
+	if (!f)
+		return 0;
+	free(f->bits);
+	free(f->ranks);
+	free(f->zeros);
+	free(f->counts);
+	free(f->count_at);
+	free(f->lengths);
+	free(f->label_at);
+	free(f->pool);
+	free(f);
+	return 0;
+}
+
+size_t ngram_frozen_size(const ngram_frozen_t *f) {
+	return f ? f->bytes : 0;
+}
+
+size_t ngram_frozen_count(const ngram_frozen_t *f, const uint8_t *const *tokens, const size_t *lengths, const int count) {
+	assert(f);
+	assert(tokens);
+	assert(lengths);
+	size_t i = 0, cnt = 0;
+	for (int t = 0; t < count; t++) {
+		size_t first = 0;
+		long l = 0, r = (long)ngram_children(f, i, &first) - 1, found = -1;
+		while (r >= l) { /* same search as 'ngram_find' */
+			const long m = l + (r - l) / 2;
+			ngram_cursor_t c;
+			size_t ml = 0, mcnt = 0;
+			ngram_seek(f, first + m, &c);
+			const uint8_t *label = ngram_step(f, &c, &mcnt, &ml);
+			const int k = ngram_compare(label, tokens[t], NGRAM_MIN(ml, lengths[t]));
+			if (!k && ml == lengths[t]) {
+				found = first + m;
+				cnt = mcnt;
+				break;
+			}
+			if (k > 0)
+				r = m - 1;
+			else
+				l = m + 1;
+		}
+		if (found < 0)
+			return 0;
+		i = found;
+	}
+	return cnt;
+}
+
+typedef struct {
+	const ngram_frozen_t *f;
+	ngram_io_t *io;
+	const ngram_print_t *p;
+	const uint8_t **path; /* labels from the root to the current node */
+	size_t *lens;
+} ngram_frozen_print_t;
+
+/* mirrors 'ngram_print_tree' */
+static int ngram_frozen_tree(ngram_frozen_print_t *fp, const size_t i, const size_t cnt, const uint8_t *m, const size_t ml, const int depth) {
+	assert(fp);
+	int r = 0;
+	const int root = i == 0;
+	if (!root) {
+		const int k = ngram_repeat(fp->io, ' ', depth);
+		if (k < 0)
+			return -1;
+		r += k;
+		const int j = ngram_output(cnt, depth >= (fp->p->min - 1), fp->p, m, ml, fp->io);
+		if (j < 0)
+			return -1;
+		r += j;
+		if (ngram_put('\n', fp->io) < 0)
+			return -1;
+	}
+	r += 1;
+	size_t first = 0;
+	const size_t l = ngram_children(fp->f, i, &first);
+	ngram_cursor_t c = { .node = 0, };
+	if (l) /* a leaf's 'first' may be one past the last node */
+		ngram_seek(fp->f, first, &c);
+	for (size_t j = 0; j < l; j++) {
+		size_t ccnt = 0, cl = 0;
+		const uint8_t *cm = ngram_step(fp->f, &c, &ccnt, &cl);
+		const int k = ngram_frozen_tree(fp, first + j, ccnt, cm, cl, depth + !root);
+		if (k < 0)
+			return -1;
+		r += k;
+	}
+	return r;
+}
+
+/* mirrors 'ngram_print_line' and 'ngram_print_up' */
+static int ngram_frozen_line(ngram_frozen_print_t *fp, const size_t i, const size_t cnt, const int depth) {
+	assert(fp);
+	const ngram_print_t *p = fp->p;
+	ngram_io_t *io = fp->io;
+	int r = 0;
+	size_t first = 0;
+	const size_t l = ngram_children(fp->f, i, &first);
+	ngram_cursor_t c = { .node = 0, };
+	if (l) /* a leaf's 'first' may be one past the last node */
+		ngram_seek(fp->f, first, &c);
+	for (size_t j = 0; j < l; j++) {
+		size_t ccnt = 0;
+		fp->path[depth] = ngram_step(fp->f, &c, &ccnt, &fp->lens[depth]);
+		const int k = ngram_frozen_line(fp, first + j, ccnt, depth + 1);
+		if (k < 0)
+			return -1;
+		r += k;
+	}
+	if (depth >= p->min && cnt) {
+		char buf[32] = { 0 };
+		if (snprintf(buf, sizeof buf, "%u%c", (unsigned)cnt, p->sep) < 0)
+			return -1;
+		const int q = ngram_sput(buf, io);
+		if (q < 0)
+			return -1;
+		r += q;
+		if (p->merge) {
+			if (ngram_put('"', io) < 0)
+				return -1;
+			r++;
+		}
+		int j = 0;
+		for (int d = 0; d < depth; d++) {
+			const int k = ngram_output(0, 0, p, fp->path[d], fp->lens[d], io);
+			if (k < 0)
+				return -1;
+			j += k;
+		}
+		if (p->merge) {
+			if (ngram_put('"', io) < 0)
+				return -1;
+			r++;
+		}
+		if (ngram_put('\n', io) < 0)
+			return -1;
+		r += j + 1;
+	}
+	return r;
+}
+
+int ngram_frozen_print(const ngram_frozen_t *f, ngram_io_t *io, const ngram_print_t *p) {
+	assert(io);
+	assert(p);
+	if (!f)
+		return 0;
+	ngram_frozen_print_t fp = { .f = f, .io = io, .p = p, };
+	fp.path = calloc(f->height + 1, sizeof *fp.path);
+	fp.lens = calloc(f->height + 1, sizeof *fp.lens);
+	int r = -1;
+	if (fp.path && fp.lens) {
+		ngram_cursor_t c;
+		size_t cnt = 0, l = 0;
+		ngram_seek(f, 0, &c);
+		const uint8_t *m = ngram_step(f, &c, &cnt, &l);
+		r = p->tree ? ngram_frozen_tree(&fp, 0, cnt, m, l, 0) : ngram_frozen_line(&fp, 0, cnt, 0);
+	}
+	free(fp.path);
+	free(fp.lens);
+	return r;
+}
+
+int ngram_free(ngram_t *n) {
+	return ngram_unmk(n);
+}
+
+typedef struct {
+	const uint8_t *b;
+	size_t l, pos;
+} ngram_memory_t; /* an 'in' for 'ngram_memory_get' */
+
+static int ngram_memory_get(void *in) {
+	assert(in);
+	ngram_memory_t *m = in;
+	return m->pos < m->l ? m->b[m->pos++] : -1;
+}
+
+/* Two sets of I/O reading the same bytes from memory, each writing into
+ * a buffer of its own, for comparing two ways of doing the same thing */
+typedef struct {
+	ngram_memory_t m[2];
+	ngram_buffer_t b[2];
+	ngram_io_t io[2];
+} ngram_pair_t;
+
+static void ngram_pair(ngram_pair_t *c, const uint8_t *b, const size_t l) {
+	assert(c);
+	memset(c, 0, sizeof *c);
+	for (int i = 0; i < 2; i++) {
+		c->m[i] = (ngram_memory_t) { .b = b, .l = l, };
+		c->io[i] = (ngram_io_t) { .get = ngram_memory_get, .put = ngram_buffer_put, .in = &c->m[i], .out = &c->b[i], };
+	}
+}
+
+static int ngram_pair_free(ngram_pair_t *c) { /* returns non-zero if the outputs match */
+	assert(c);
+	const int r = c->b[0].l == c->b[1].l && (!c->b[0].l || !memcmp(c->b[0].b, c->b[1].b, c->b[0].l));
+	free(c->b[0].b);
+	free(c->b[1].b);
+	return r;
+}
+
+#if NGRAM_BYTE_MODE != 0
+static size_t ngram_width(const ngram_t *n, const int depth) { /* nodes at 'depth' */
+	assert(n);
+	if (!depth)
+		return 1;
+	size_t r = 0;
+	for (size_t i = 0; i < n->nl; i++)
+		r += ngram_width(n->ns[i], depth - 1);
+	return r;
+}
+
+#endif
+
+static int ngram_same(const ngram_t *a, const ngram_t *b) {
+	if (!a || !b)
+		return a == b;
+	if (a->ml != b->ml || a->nl != b->nl || a->cnt != b->cnt || memcmp(a->m, b->m, a->ml))
+		return 0;
+	for (size_t i = 0; i < a->nl; i++)
+		if (!ngram_same(a->ns[i], b->ns[i]))
+			return 0;
+	return 1;
+}
+
+typedef struct {
+	ngram_shared_t *s;
+	const uint8_t *b;
+	size_t l;
+	int r;
+} ngram_feeder_t;
+
+static void *ngram_feeder(void *arg) {
+	assert(arg);
+	ngram_feeder_t *f = arg;
+	ngram_memory_t m = { .b = f->b, .l = f->l, };
+	ngram_io_t io = { .get = ngram_memory_get, .in = &m, };
+	f->r = ngram_shared_feed(f->s, &io, 3, (const uint8_t*)" ", 1);
+	return NULL;
+}
+
+static int ngram_shared_test(const uint8_t *b, const size_t l) {
+	enum { NGRAM_FEEDERS = 4, };
+	ngram_feeder_t fs[NGRAM_FEEDERS];
+	ngram_shared_t *a = ngram_shared(), *e = ngram_shared();
+	ngram_t *x = NULL, *y = NULL;
+	int r = -1;
+	if (!a || !e)
+		goto fail;
+	for (int i = 0; i < NGRAM_FEEDERS; i++) {
+		fs[i] = (ngram_feeder_t) { .s = e, .b = b, .l = l, };
+		ngram_feeder(&fs[i]);
+		if (fs[i].r < 0)
+			goto fail;
+		fs[i].s = a;
+	}
+#if NGRAM_THREADS
+	pthread_t ts[NGRAM_FEEDERS];
+	int created = 0;
+	for (; created < NGRAM_FEEDERS; created++)
+		if (pthread_create(&ts[created], NULL, ngram_feeder, &fs[created]))
+			break;
+	for (int i = 0; i < created; i++)
+		pthread_join(ts[i], NULL);
+	for (int i = created; i < NGRAM_FEEDERS; i++)
+		ngram_feeder(&fs[i]);
+#else
+	for (int i = 0; i < NGRAM_FEEDERS; i++)
+		ngram_feeder(&fs[i]);
+#endif
+	for (int i = 0; i < NGRAM_FEEDERS; i++)
+		if (fs[i].r < 0)
+			goto fail;
+	x = ngram_shared_snapshot(a);
+	y = ngram_shared_snapshot(e);
+	r = x && y && ngram_same(x, y) ? 0 : -1;
+fail:
+	ngram_unmk(x);
+	ngram_unmk(y);
+	ngram_shared_free(a);
+	ngram_shared_free(e);
+	return r;
+}
+
+#if NGRAM_BYTE_MODE != 0
+static int ngram_frozen_test(const ngram_t *n, const ngram_frozen_t *f, const uint8_t **tokens, size_t *lengths, const int depth) {
+	assert(n);
+	if (depth && ngram_frozen_count(f, tokens, lengths, depth) != n->cnt)
+		return -1;
+	for (size_t i = 0; i < n->nl; i++) {
+		tokens[depth] = n->ns[i]->m;
+		lengths[depth] = n->ns[i]->ml;
+		if (ngram_frozen_test(n->ns[i], f, tokens, lengths, depth + 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* a frozen tree prints the same as the tree it was made from */
+static int ngram_frozen_same(const ngram_t *n, const ngram_frozen_t *f) {
+	assert(n);
+	int r = 1;
+	for (int mode = 0; r && mode < 4; mode++) {
+		const ngram_print_t p = { .min = 1 + (mode & 1), .max = 4, .sep = ',', .threads = 1, .tree = mode & 1, .merge = mode >> 1, };
+		ngram_pair_t c;
+		ngram_pair(&c, NULL, 0);
+		const int r1 = ngram_print(n, &c.io[0], &p), r2 = ngram_frozen_print(f, &c.io[1], &p);
+		r = ngram_pair_free(&c) && r1 >= 0 && r1 == r2;
+	}
+	return r;
+}
+#endif
+
+int ngram_tests(void) {
+	if (!NGRAM_DEBUGGING)
+		return 0;
+	static const uint8_t text[] = "abcabcaab\0\377\377ab the cat sat on the mat";
+	for (int max = 1; max <= NGRAM_PACKED_MAX && (NGRAM_MAX_N <= 0 || max <= NGRAM_MAX_N); max++) { /* packed keys vs. tree */
+		for (size_t l = 0; l < sizeof text; l += 7) {
+			ngram_pair_t c;
+			ngram_pair(&c, text, l);
+			ngram_t *a = ngram_packed(&c.io[0], max, 0), *b = ngram_generate(&c.io[1], max, NULL, 1, 1);
+			const int r = ngram_same(a, b) && ngram_pair_free(&c);
+			ngram_unmk(a);
+			ngram_unmk(b);
+			if (!r)
+				return -1;
+		}
+	}
+	/* concurrent feeders vs. one, the words are all the same length as
+	 * the order of siblings that prefix each other depends on the order
+	 * they were inserted in */
+	uint8_t words[1 << 16];
+	for (size_t i = 0, x = 1; i < sizeof words; i++) {
+		x = x * 1103515245ul + 12345ul;
+		words[i] = i % 4 == 3 ? ' ' : 'a' + (x >> 20) % 8;
+	}
+	if (ngram_shared_test(words, sizeof words) < 0)
+		return -1;
+	for (int n = 1; n <= 3 && (NGRAM_MAX_N <= 0 || n <= NGRAM_MAX_N); n++) { /* parallel vs. serial printing */
+		ngram_pair_t c;
+		ngram_pair(&c, words, sizeof words);
+		ngram_t *t = ngram_generate(&c.io[0], n, NULL, 1, 1);
+		int r = t && ngram_pair_free(&c) ? 0 : -1;
+		for (int mode = 0; r >= 0 && mode < 8; mode++) { /* whole tree, then a subtree */
+			const ngram_t *s = mode & 4 ? t->ns[0] : t;
+			ngram_print_t p = { .min = mode & 4 ? 0 : 1 + (n > 1), .max = n, .sep = ',', .threads = 1, .tree = mode & 1, .merge = (mode >> 1) & 1, };
+			ngram_pair(&c, NULL, 0);
+			const int r1 = ngram_print(s, &c.io[0], &p);
+			p.threads = 3;
+			const int r2 = ngram_print(s, &c.io[1], &p);
+			r = ngram_pair_free(&c) && r1 >= 0 && r1 == r2 ? 0 : -1;
+		}
+		ngram_free(t);
+		if (r < 0)
+			return -1;
+	}
+	/* the rest count single bytes, and so need byte mode */
+#if NGRAM_BYTE_MODE != 0
+	for (int n = 1; n <= 4 && (NGRAM_MAX_N <= 0 || n <= NGRAM_MAX_N); n++) { /* every n-gram can be found when frozen */
+		ngram_memory_t m = { .b = words, .l = sizeof words, };
+		ngram_io_t io = { .get = ngram_memory_get, .in = &m, };
+		ngram_t *t = ngram(&io, n, NULL, n % 2 + 1);
+		ngram_frozen_t *f = ngram_freeze(t);
+		const uint8_t *tokens[4] = { NULL, }, *none[1] = { (const uint8_t*)"\1" };
+		size_t lengths[4] = { 0, }, one[1] = { 1, };
+		const int r = t && f && !ngram_frozen_test(t, f, tokens, lengths, 0) &&
+			!ngram_frozen_count(f, none, one, 1) && ngram_frozen_same(t, f);
+		ngram_frozen_free(f);
+		ngram_free(t);
+		if (!r)
+			return -1;
+	}
+	{ /* 63 distinct bytes, with the root a multiple of NGRAM_FROZEN_SAMPLE nodes */
+		uint8_t bytes[NGRAM_FROZEN_SAMPLE - 1];
+		for (size_t i = 0; i < sizeof bytes; i++)
+			bytes[i] = 'A' + i;
+		ngram_memory_t m = { .b = bytes, .l = sizeof bytes, };
+		ngram_io_t io = { .get = ngram_memory_get, .in = &m, };
+		ngram_t *t = ngram(&io, 1, NULL, 1);
+		ngram_frozen_t *f = ngram_freeze(t);
+		const int r = t && f && f->nodes % NGRAM_FROZEN_SAMPLE == 0 && ngram_frozen_same(t, f);
+		ngram_frozen_free(f);
+		ngram_free(t);
+		if (!r)
+			return -1;
+	}
+	for (int n = 1; n <= 4 && (NGRAM_MAX_N <= 0 || n <= NGRAM_MAX_N); n++) { /* epochs covering everything vs. one pass */
+		ngram_pair_t c;
+		ngram_pair(&c, words, sizeof words);
+		ngram_window_t *w = ngram_window(n, NULL, 1, 1000, sizeof words / 1000 + 1, 1.0);
+		int r = w ? 0 : -1;
+		while (r >= 0 && (r = ngram_window_feed(w, &c.io[0])) > 0)
+			;
+		ngram_t *a = r < 0 ? NULL : ngram_window_snapshot(w), *b = ngram(&c.io[1], n, NULL, 1);
+		r = a && b && ngram_same(a, b) && ngram_pair_free(&c);
+		ngram_free(a);
+		ngram_free(b);
+		ngram_window_free(w);
+		if (!r)
+			return -1;
+	}
+	for (int max = 1; max <= 12 && (NGRAM_MAX_N <= 0 || max <= NGRAM_MAX_N); max += 1 + max / 4) { /* sorting vs. tree */
+		for (int merge = 0; merge < 2; merge++) {
+			const ngram_print_t p = { .min = 1, .max = max, .sep = ',', .threads = 2, .merge = merge, };
+			ngram_pair_t c;
+			ngram_pair(&c, words, sizeof words);
+			ngram_t *t = ngram(&c.io[0], max, NULL, 1);
+			const int r = t && ngram_print(t, &c.io[0], &p) >= 0 && ngram_batch(&c.io[1], max, &p) >= 0;
+			ngram_free(t);
+			if (!ngram_pair_free(&c) || !r)
+				return -1;
+		}
+	}
+	for (int max = 1; max <= 4 && (NGRAM_MAX_N <= 0 || max <= NGRAM_MAX_N); max++) { /* estimates are within 10% */
+		ngram_pair_t c;
+		ngram_pair(&c, words, sizeof words);
+		double estimates[4] = { 0, };
+		size_t bytes = 0;
+		ngram_t *t = ngram_estimate(&c.io[0], max, NULL, 1, estimates, &bytes) < 0 ? NULL : ngram_sized(&c.io[1], max, NULL, 1, estimates);
+		int r = t && bytes && ngram_pair_free(&c);
+		for (int k = 0; r && k < max; k++) {
+			const double w = ngram_width(t, k + 1);
+			r = estimates[k] > w * 0.9 && estimates[k] < w * 1.1;
+		}
+		ngram_free(t);
+		if (!r)
+			return -1;
+	}
+#endif
+	return 0;
+}
+
+/* helper macros are not for the includer */
+#undef NGRAM_BINARY_SEARCH
+#undef NGRAM_DEBUGGING
+#undef NGRAM_FROZEN_SAMPLE
+#undef NGRAM_INLINE
+#undef NGRAM_MAX
+#undef NGRAM_MIN
+#undef NGRAM_PACKED_MAX
+#undef NGRAM_QUOTE_LEFT
+#undef NGRAM_QUOTE_RIGHT
+#undef NGRAM_RANK_BLOCK
+#undef NGRAM_SELECT_SAMPLE
+#undef NGRAM_SHARED_BATCH
+#undef NGRAM_SHARED_STRIPES
+#undef NGRAM_SKETCH_BITS
+#undef NGRAM_SORT_SMALL
+#endif
+#endif